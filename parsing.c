@@ -1,5 +1,7 @@
 
 #include "mpc.h"
+#include <time.h>
+#include <limits.h>
 
 #define LASSERT(args, cond, fmt, ...) if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
 #define LASSERT_TYPE(func, args, index, expect) LASSERT(args, args->cell[index]->type == expect, \
@@ -7,6 +9,24 @@
 					func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
 #define LASSERT_NUM(func, args, num) LASSERT(args, args->count == num, "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
 					func, args->count, num);
+#define LASSERT_NUMBER(func, args, index) LASSERT(args, lval_is_number(args->cell[index]), \
+					 "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+					func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_NUM))
+#define LASSERT_SEQUENCE(func, args, index) LASSERT(args, args->cell[index]->type == LVAL_QEXPR \
+					|| args->cell[index]->type == LVAL_VEC || args->cell[index]->type == LVAL_ARR, \
+					 "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s, %s or %s.", \
+					func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC), ltype_name(LVAL_ARR))
+#define LASSERT_INDEX(func, args, index, seq) LASSERT_TYPE(func, args, index, LVAL_INT) \
+				LASSERT(args, args->cell[index]->integer >= 0 && args->cell[index]->integer < lval_length(args->cell[seq]), \
+					 "Function '%s' passed index %lli for argument %i, out of range for length %i.", \
+					func, args->cell[index]->integer, index, lval_length(args->cell[seq]))
+#define LASSERT_MATRIX(func, args, index) LASSERT_TYPE(func, args, index, LVAL_ARR) \
+				LASSERT(args, args->cell[index]->arr.rows >= 0, \
+					 "Function '%s' passed a flat Array for argument %i, Expected a matrix.", func, index)
+#define LASSERT_HASH(func, args, index) LASSERT(args, args->cell[index]->type == LVAL_MAP \
+					|| args->cell[index]->type == LVAL_SET, \
+					 "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.", \
+					func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_MAP), ltype_name(LVAL_SET))
 #define LASSERT_NOT_EMPTY(func, args, index) LASSERT(args, args->cell[index]->count != 0, \
 						  "Function '%s' passed {} for argument %i.", func, index);
 
@@ -43,875 +63,5213 @@ mpc_parser_t* Tea;
 
 struct lval;
 struct lenv;
+struct lcode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lcells lcells;
+typedef struct lhash lhash;
+typedef struct lnode lnode;
 
 enum {
 	LVAL_ERR,
 	LVAL_NUM,
+	LVAL_INT,
+	LVAL_BIG,
 	LVAL_BOOL,
 	LVAL_SYM,
 	LVAL_STR,
 	LVAL_FUN,
 	LVAL_SEXPR,
-	LVAL_QEXPR
+	LVAL_QEXPR,
+	LVAL_VEC,
+	LVAL_ARR,
+	LVAL_MAP,
+	LVAL_SET,
+	LVAL_PVEC,
+	LVAL_PMAP,
+	LVAL_REC,
+	LVAL_BOX
 };
 
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
+typedef struct {
+	int sign;
+	int size;
+	unsigned* limbs;
+} lbig;
+
+/* Numbers of a single type, stored unboxed and contiguously */
+enum { LARR_I64, LARR_F64 };
+
+typedef struct {
+	int kind;
+	int count;
+	/* Shape of a matrix stored row by row, 'rows' is -1 for a flat array */
+	int rows;
+	int cols;
+	union {
+		long long* i64;
+		double* f64;
+	};
+} larr;
+
+/* A persistent vector or map, see Persistent Collections */
+typedef struct {
+	int count;
+	/* Bits of the index consumed above the leaves of a vector's trie */
+	int shift;
+	lnode* root;
+	/* The last up to 32 elements of a vector, kept out of the trie so appends are cheap */
+	lnode* tail;
+} ltrie;
+
+/* Strings shorter than this keep their characters inside the value */
+#define LSTR_SMALL 16
+
+/* Reference count of values that are never freed */
+#define LVAL_IMMORTAL -1
+
 typedef struct lval {
 	int type;
+	int refs;
+	int gc_slot;
+	/* How many hash keys a list, vector or table is currently part of, see lval_key_ref */
+	int keyed;
+
+	/* Only the fields of the value's own type are stored */
+	union {
+		double num;
+		long long integer;
+		lbig big;
+		larr arr;
+		lhash* hash;
+		ltrie trie;
+		int bool;
+		char* err;
+		char* sym;
+		/* A frame variable shared with the closures made in that frame, NULL
+		 * while the symbol is not bound yet */
+		lval* boxed;
+
+		/* A string is flat, or a rope of the two strings 'left' then
+		 * 'right' with 'str' NULL until its characters are first needed.
+		 * Short flat strings keep their characters in 'small', and long
+		 * substrings can be a view into the buffer of the string 'left' */
+		struct {
+			char* str;
+			long len;
+			union {
+				struct {
+					lval* left;
+					lval* right;
+				};
+				char small[LSTR_SMALL];
+			};
+			/* 0 until first needed */
+			unsigned long str_hash;
+		};
+
+		/* A builtin's 'body' is NULL or data it is passed ahead of its arguments */
+		struct {
+			lbuiltin builtin;
+			char* fun_name;
+			lenv* env;
+			lval* formals;
+			lval* body;
+		};
+
+		/* Field values in the order the record type {name field ...} lists them */
+		struct {
+			lval* rtype;
+			lval** fields;
+		};
+
+		struct {
+			int count;
+			struct lval** cell;
+			/* Bytecode for evaluating this list as an S-expression, compiled on demand */
+			lcode* code;
+			/* Buffer the cells live in, possibly shared with other slices */
+			lcells* cells;
+		};
+	};
+} lval;
+
+/* Storage behind one or more lists. Each list sees 'count' slots from its
+ * 'cell' pointer; the buffer holds one reference for every slot in [lo, hi)
+ * and the slots outside are free for either end to grow into */
+struct lcells {
+	int refs;
+	int gc_slot;
+	int lo;
+	int hi;
+	int size;
+	lval* slots[];
+};
 
-	double num;
-	int bool;
-	char* err;
-	char* sym;
-	char* str;
+/*
+ * Maps and sets keep their entries in insertion order with an open-addressing
+ * index over them, kept at most half full, like environment frames. Removing
+ * an entry leaves a hole in place that the next rebuild compacts away. Keys
+ * hash structurally and agree with lval_eq: numbers hash through their double
+ * value since 1 and 1.0 are equal, and maps and sets add up their entries'
+ * hashes so the order they were filled in does not matter.
+ */
+struct lhash {
+	int count;
+	int used;
+	int capacity;
+	int is_map;
+	lval** keys;
+	/* Unused for a set */
+	lval** vals;
+	unsigned long* hashes;
 
-	lbuiltin builtin;
-	char* fun_name;
-	lenv* env;
-	lval* formals;
-	lval* body;
+	int index_capacity;
+	int* index;
+};
 
+/* Persistent vectors are 32-way tries indexed by 5 bits per level, persistent
+ * maps are hash array mapped tries branching on 5 bits of the key's hash */
+#define PTRIE_BITS 5
+#define PTRIE_WIDTH (1 << PTRIE_BITS)
+#define PTRIE_MASK (PTRIE_WIDTH - 1)
+
+enum { LNODE_LEAF, LNODE_BRANCH, LNODE_MAP, LNODE_COLLISION };
+
+/* A trie node, shared between every version of a collection that has it.
+ * Leaves hold elements and branches hold child nodes; map and collision
+ * nodes hold 'count' key value pairs, where a map entry with a NULL key
+ * holds a child node in place of its value */
+struct lnode {
+	int refs;
+	int gc_slot;
+	int kind;
 	int count;
-	struct lval** cell;
-} lval;
+	/* Map nodes: which 5-bit chunks of the hash have an entry here */
+	unsigned bitmap;
+	/* Collision nodes: the hash all their keys share */
+	unsigned hash;
+	void* slots[];
+};
+
+/* Frames up to this size are scanned linearly, larger ones get a hash index */
+#define LENV_INLINE_MAX 8
 
 struct lenv {
+	int refs;
+	int gc_slot;
+
 	lenv* par;
 	int count;
+	int capacity;
 	char** syms;
 	lval** vals;
+
+	int index_capacity;
+	int* index;
+
+	/* Function frames keep the symbols of their slots in order (captured
+	 * variables, then formals), how many of those are captured, how many
+	 * formals are bound so far and how many slots were filled before any '='
+	 * added more */
+	lval* layout;
+	int captured;
+	int bound;
+	int slots;
 };
 
 
+/* Symbol Interning */
+
+typedef struct {
+	int count;
+	int capacity;
+	char** names;
+} latoms;
+
+latoms atoms;
+
+char* atom_exit;
+char* atom_print_all;
+char* atom_if;
+char* atom_def;
+char* atom_put;
+char* atom_lambda;
+char* atom_amp;
+
+unsigned long atom_hash(char* s) {
+	unsigned long h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void atoms_grow(void) {
+	int old_capacity = atoms.capacity;
+	char** old_names = atoms.names;
+
+	atoms.capacity = old_capacity ? old_capacity * 2 : 256;
+	atoms.names = calloc(atoms.capacity, sizeof(char*));
+
+	for (int i = 0; i < old_capacity; i++) {
+		if (!old_names[i]) continue;
+
+		unsigned long j = atom_hash(old_names[i]) & (atoms.capacity - 1);
+		while (atoms.names[j]) j = (j + 1) & (atoms.capacity - 1);
+		atoms.names[j] = old_names[i];
+	}
+
+	free(old_names);
+}
+
+/* Returns the unique copy of 's', so interned symbols compare by pointer */
+char* atom_intern(char* s) {
+	if ((atoms.count + 1) * 2 > atoms.capacity) atoms_grow();
+
+	unsigned long i = atom_hash(s) & (atoms.capacity - 1);
+	while (atoms.names[i]) {
+		if (strcmp(atoms.names[i], s) == 0) return atoms.names[i];
+		i = (i + 1) & (atoms.capacity - 1);
+	}
+
+	atoms.names[i] = malloc(strlen(s) + 1);
+	strcpy(atoms.names[i], s);
+	atoms.count++;
+
+	return atoms.names[i];
+}
+
+void atoms_init(void) {
+	atom_exit = atom_intern("exit");
+	atom_print_all = atom_intern("print_all");
+	atom_if = atom_intern("if");
+	atom_def = atom_intern("def");
+	atom_put = atom_intern("=");
+	atom_lambda = atom_intern("\\");
+	atom_amp = atom_intern("&");
+}
+
+void atoms_cleanup(void) {
+	for (int i = 0; i < atoms.capacity; i++) {
+		free(atoms.names[i]);
+	}
+	free(atoms.names);
+	atoms.names = NULL;
+	atoms.count = 0;
+	atoms.capacity = 0;
+}
+
 void lval_print(lval* v);
 void lenv_del(lenv* e);
+void lcode_del(lcode* c);
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_list(lenv* e, lval* v);
 lval* lval_copy(lval* v);
 lval* lval_read(mpc_ast_t* t);
+lval* lval_parse_int(char* s);
 
 char* ltype_name(int t) {
 	switch (t) {
 	case LVAL_FUN: return "Function";
 	case LVAL_NUM: return "Number";
+	case LVAL_INT:
+	case LVAL_BIG: return "Integer";
 	case LVAL_BOOL: return "Boolean";
 	case LVAL_ERR: return "Error";
 	case LVAL_SYM: return "Symbol";
 	case LVAL_STR: return "String";
 	case LVAL_SEXPR: return "S-Expression";
 	case LVAL_QEXPR: return "Q-Expression";
+	case LVAL_VEC: return "Vector";
+	case LVAL_ARR: return "Array";
+	case LVAL_MAP: return "Map";
+	case LVAL_SET: return "Set";
+	case LVAL_PVEC: return "Persistent Vector";
+	case LVAL_PMAP: return "Persistent Map";
+	case LVAL_REC: return "Record";
+	case LVAL_BOX: return "Box";
 	default: return "Unknown";
 	}
 }
 
-long power(double x, double y) {
-	double result = x;
-	for (int i = 1; i < y; i++) {
-		result = result * x;
-	}
+int lval_is_exact(lval* v) {
+	return v->type == LVAL_INT || v->type == LVAL_BIG;
+}
 
-	return result;
+int lval_is_number(lval* v) {
+	return lval_is_exact(v) || v->type == LVAL_NUM;
 }
 
-int max_children(mpc_ast_t* t) {
+/* Elements in a Q-Expression, Vector, Array or Persistent Vector */
+int lval_length(lval* v) {
+	if (v->type == LVAL_PVEC) return v->trie.count;
+	return v->type == LVAL_ARR ? v->arr.count : v->count;
+}
 
-	if (t->children_num == 0) {
-		return 0;
-	}
+double lbig_to_double(lbig* x);
 
-	// Start by assuming the current node has the maximum children
-	int max_count = t->children_num;
+double lval_to_double(lval* v) {
+	if (v->type == LVAL_BIG) return lbig_to_double(&v->big);
+	return v->type == LVAL_INT ? (double)v->integer : v->num;
+}
 
-	// Recursively check the children
-	for (int i = 0; i < t->children_num; i++) {
-		int child_max = max_children(t->children[i]);
-		if (child_max > max_count) {
-			max_count = child_max;
-		}
-	}
+/* Exact integer arithmetic: each returns 0 rather than overflow, leaving '*r' alone */
+int lint_add(long long x, long long y, long long* r) {
+	if ((y > 0 && x > LLONG_MAX - y) || (y < 0 && x < LLONG_MIN - y)) return 0;
+	*r = x + y;
+	return 1;
+}
 
-	return max_count;
+int lint_sub(long long x, long long y, long long* r) {
+	if ((y < 0 && x > LLONG_MAX + y) || (y > 0 && x < LLONG_MIN + y)) return 0;
+	*r = x - y;
+	return 1;
 }
 
-int countBranches(mpc_ast_t* t) {
+int lint_mul(long long x, long long y, long long* r) {
+	if (x > 0 && y > 0 && x > LLONG_MAX / y) return 0;
+	if (x > 0 && y < 0 && y < LLONG_MIN / x) return 0;
+	if (x < 0 && y > 0 && x < LLONG_MIN / y) return 0;
+	if (x < 0 && y < 0 && x < LLONG_MAX / y) return 0;
+	*r = x * y;
+	return 1;
+}
 
-	if (t->children_num == 0) return 0;
+/* A sum of fewer than 2^31 values kept as the sum 'hi' of their signed high
+ * words and the sum 'lo' of their unsigned low words, neither of which can
+ * overflow. Only the total has to fit, whatever order it was added up in */
+int lint_join(long long hi, unsigned long long lo, long long* r) {
+	hi += lo >> 32;
+	if (hi < -2147483648LL || hi > 2147483647LL) return 0;
+	*r = (long long)(((unsigned long long)hi << 32) | (lo & 0xFFFFFFFFULL));
+	return 1;
+}
 
-	int branch_count = 1;
-	for (int i = 0; i < t->children_num; i++) {
-		branch_count = branch_count + countBranches(t->children[i]);
+/* Exponentiation by squaring, 'y' must not be negative */
+int lint_pow(long long x, long long y, long long* r) {
+	long long result = 1;
+	while (y > 0) {
+		if ((y & 1) && !lint_mul(result, x, &result)) return 0;
+		y >>= 1;
+		if (y > 0 && !lint_mul(x, x, &x)) return 0;
 	}
-
-	return branch_count;
+	*r = result;
+	return 1;
 }
 
-int countLeaves(mpc_ast_t* t) {
+/* Arbitrary-Precision Integers */
 
-	if (t->children_num == 0) return 1;
+/*
+ * Integers that do not fit a long long are stored as a sign and a magnitude
+ * of 32-bit limbs, least significant first, with no leading zero limbs.
+ * Values are normalized on the way back into an lval, so a bignum never
+ * holds something an LVAL_INT could. Functions working on magnitudes take
+ * a limb array and its length and return the length of their result.
+ */
+#define KARATSUBA_THRESHOLD 32
 
-	int leaf_count = 0;
-	for (int i = 0; i < t->children_num; i++) {
-		leaf_count = leaf_count + countLeaves(t->children[i]);
-	}
+int mag_trim(unsigned* a, int n) {
+	while (n > 0 && a[n - 1] == 0) n--;
+	return n;
+}
 
-	return leaf_count;
+int mag_cmp(unsigned* a, int an, unsigned* b, int bn) {
+	if (an != bn) return an < bn ? -1 : 1;
+	for (int i = an - 1; i >= 0; i--) {
+		if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
 }
 
-lenv* lenv_new(void) {
-	lenv* e = malloc(sizeof(lenv));
-	e->par = NULL;
-	e->count = 0;
-	e->syms = NULL;
-	e->vals = NULL;
-	return e;
+/* 'r' has room for one limb more than the longer operand, and may be 'a' */
+int mag_add(unsigned* r, unsigned* a, int an, unsigned* b, int bn) {
+	if (an < bn) {
+		unsigned* t = a; a = b; b = t;
+		int tn = an; an = bn; bn = tn;
+	}
+
+	unsigned long long carry = 0;
+	for (int i = 0; i < an; i++) {
+		carry += (unsigned long long)a[i] + (i < bn ? b[i] : 0);
+		r[i] = (unsigned)carry;
+		carry >>= 32;
+	}
+	r[an] = (unsigned)carry;
+	return mag_trim(r, an + 1);
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
+/* Requires a >= b, 'r' may be 'a' */
+int mag_sub(unsigned* r, unsigned* a, int an, unsigned* b, int bn) {
+	long long borrow = 0;
+	for (int i = 0; i < an; i++) {
+		long long d = (long long)a[i] - (i < bn ? b[i] : 0) - borrow;
+		borrow = d < 0;
+		r[i] = (unsigned)(d + (borrow ? 4294967296LL : 0));
+	}
+	return mag_trim(r, an);
+}
 
-	v->builtin = NULL;
-	v->fun_name = malloc(strlen("user function") + 1);
-	strcpy(v->fun_name, "user function");
+/* Adds 'x' into 'r' starting 'shift' limbs up, 'r' is long enough for the sum */
+void mag_add_at(unsigned* r, int rn, int shift, unsigned* x, int xn) {
+	unsigned long long carry = 0;
+	for (int i = 0; i < xn || carry; i++) {
+		if (shift + i >= rn) break;
+		carry += (unsigned long long)r[shift + i] + (i < xn ? x[i] : 0);
+		r[shift + i] = (unsigned)carry;
+		carry >>= 32;
+	}
+}
 
-	v->env = lenv_new();
+void mag_mul(unsigned* r, unsigned* a, int an, unsigned* b, int bn);
 
-	v->formals = formals;
-	v->body = body;
-	return v;
+void mag_mul_school(unsigned* r, unsigned* a, int an, unsigned* b, int bn) {
+	memset(r, 0, sizeof(unsigned) * (an + bn));
+	for (int i = 0; i < an; i++) {
+		unsigned long long carry = 0;
+		for (int j = 0; j < bn; j++) {
+			carry += (unsigned long long)a[i] * b[j] + r[i + j];
+			r[i + j] = (unsigned)carry;
+			carry >>= 32;
+		}
+		r[i + bn] = (unsigned)carry;
+	}
 }
 
-lval* lval_num(double x) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_NUM;
-	v->num = x;
-	return v;
+/* Splits both operands at 'm' limbs: a*b = z2*B^2m + z1*B^m + z0 with
+ * z1 = (a0+a1)(b0+b1) - z0 - z2, three half-size products instead of four */
+void mag_mul_karatsuba(unsigned* r, unsigned* a, int an, unsigned* b, int bn, int m) {
+	int a0n = mag_trim(a, m), b0n = mag_trim(b, m);
+	int a1n = an - m, b1n = bn - m;
+
+	unsigned* z0 = malloc(sizeof(unsigned) * (a0n + b0n + 1));
+	unsigned* z2 = malloc(sizeof(unsigned) * (a1n + b1n + 1));
+	mag_mul(z0, a, a0n, b, b0n);
+	mag_mul(z2, a + m, a1n, b + m, b1n);
+	int z0n = mag_trim(z0, a0n + b0n);
+	int z2n = mag_trim(z2, a1n + b1n);
+
+	unsigned* sa = malloc(sizeof(unsigned) * ((a1n > m ? a1n : m) + 1));
+	unsigned* sb = malloc(sizeof(unsigned) * ((b1n > m ? b1n : m) + 1));
+	int san = mag_add(sa, a, a0n, a + m, a1n);
+	int sbn = mag_add(sb, b, b0n, b + m, b1n);
+
+	unsigned* z1 = malloc(sizeof(unsigned) * (san + sbn + 1));
+	mag_mul(z1, sa, san, sb, sbn);
+	int z1n = mag_trim(z1, san + sbn);
+	z1n = mag_sub(z1, z1, z1n, z0, z0n);
+	z1n = mag_sub(z1, z1, z1n, z2, z2n);
+
+	memset(r, 0, sizeof(unsigned) * (an + bn));
+	mag_add_at(r, an + bn, 0, z0, z0n);
+	mag_add_at(r, an + bn, m, z1, z1n);
+	mag_add_at(r, an + bn, 2 * m, z2, z2n);
+
+	free(z0);
+	free(z1);
+	free(z2);
+	free(sa);
+	free(sb);
 }
 
-lval* lval_bool(int x) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_BOOL;
-	v->bool = x;
-	return v;
+/* 'r' has room for an + bn limbs and must not overlap either operand */
+void mag_mul(unsigned* r, unsigned* a, int an, unsigned* b, int bn) {
+	int m = (an > bn ? an : bn) / 2;
+
+	if (an < KARATSUBA_THRESHOLD || bn < KARATSUBA_THRESHOLD || an <= m || bn <= m) {
+		mag_mul_school(r, a, an, b, bn);
+		return;
+	}
+
+	mag_mul_karatsuba(r, a, an, b, bn, m);
 }
 
-lval* lval_err(char* fmt, ...) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_ERR;
+/* Divides 'a' by a single limb in place, returning the remainder */
+unsigned mag_div_limb(unsigned* a, int an, unsigned d) {
+	unsigned long long rem = 0;
+	for (int i = an - 1; i >= 0; i--) {
+		rem = (rem << 32) | a[i];
+		a[i] = (unsigned)(rem / d);
+		rem %= d;
+	}
+	return (unsigned)rem;
+}
 
-	va_list va;
-	va_start(va, fmt);
+/* Shift-subtract long division: 'q' has room for 'an' limbs and 'r' for bn + 1 */
+void mag_divmod(unsigned* q, int* qn, unsigned* r, int* rn, unsigned* a, int an, unsigned* b, int bn) {
+	memset(q, 0, sizeof(unsigned) * an);
 
-	v->err = malloc(512);
+	if (bn == 1) {
+		memcpy(q, a, sizeof(unsigned) * an);
+		r[0] = mag_div_limb(q, an, b[0]);
+		*qn = mag_trim(q, an);
+		*rn = mag_trim(r, 1);
+		return;
+	}
 
-	vsnprintf(v->err, 511, fmt, va);
+	int n = 0;
+	for (int i = an * 32 - 1; i >= 0; i--) {
+		/* r = r * 2 + next bit of a */
+		unsigned bit = (a[i / 32] >> (i % 32)) & 1;
+		for (int j = n; j > 0; j--) r[j] = (r[j] << 1) | (r[j - 1] >> 31);
+		r[0] = (r[0] << 1) | bit;
+		n = mag_trim(r, n + 1);
+
+		if (mag_cmp(r, n, b, bn) >= 0) {
+			n = mag_sub(r, r, n, b, bn);
+			q[i / 32] |= 1u << (i % 32);
+		}
+	}
 
-	v->err = realloc(v->err, strlen(v->err) + 1);
+	*qn = mag_trim(q, an);
+	*rn = n;
+}
 
-	va_end(va);
+lbig lbig_from_int(long long x) {
+	unsigned long long u = x < 0 ? -(unsigned long long)x : (unsigned long long)x;
 
-	return v;
+	lbig b = { .sign = x < 0 ? -1 : x > 0, .size = 0, .limbs = malloc(sizeof(unsigned) * 2) };
+	b.limbs[0] = (unsigned)u;
+	b.limbs[1] = (unsigned)(u >> 32);
+	b.size = mag_trim(b.limbs, 2);
+	return b;
 }
 
-lval* lval_sym(char* s) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(s) + 1);
-	strcpy(v->sym, s);
-	return v;
+/* Borrows the integer value of 'v' without allocating, 'tmp' holds the limbs of a small one */
+lbig lbig_view(lval* v, unsigned* tmp) {
+	if (v->type == LVAL_BIG) return v->big;
+
+	long long x = v->integer;
+	unsigned long long u = x < 0 ? -(unsigned long long)x : (unsigned long long)x;
+	tmp[0] = (unsigned)u;
+	tmp[1] = (unsigned)(u >> 32);
+
+	lbig b = { .sign = x < 0 ? -1 : x > 0, .size = mag_trim(tmp, 2), .limbs = tmp };
+	return b;
 }
 
-lval* lval_str(char* s) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_STR;
-	v->str = malloc(strlen(s) + 1);
-	strcpy(v->str, s);
-	return v;
+lbig lbig_copy(lbig* x) {
+	lbig b = { .sign = x->sign, .size = x->size, .limbs = malloc(sizeof(unsigned) * (x->size + 1)) };
+	memcpy(b.limbs, x->limbs, sizeof(unsigned) * x->size);
+	return b;
 }
 
-lval* lval_fun(lbuiltin func, char* func_name) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
-	v->builtin = func;
-	v->fun_name = malloc(strlen(func_name) + 1);
-	strcpy(v->fun_name, func_name);
-	return v;
+void lbig_free(lbig* x) {
+	free(x->limbs);
+	x->limbs = NULL;
+	x->size = 0;
+	x->sign = 0;
 }
 
-lval* lval_sexpr(void) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SEXPR;
-	v->count = 0;
-	v->cell = NULL;
-	return v;
+/* Replaces '*x' with 'r', releasing what it held */
+void lbig_set(lbig* x, lbig r) {
+	free(x->limbs);
+	if (r.size == 0) r.sign = 0;
+	*x = r;
 }
 
-lval* lval_qexpr(void) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_QEXPR;
-	v->count = 0;
-	v->cell = NULL;
-	return v;
+int lbig_cmp(lbig* x, lbig* y) {
+	if (x->sign != y->sign) return x->sign < y->sign ? -1 : 1;
+	int c = mag_cmp(x->limbs, x->size, y->limbs, y->size);
+	return x->sign < 0 ? -c : c;
 }
 
-void lval_del(lval* v) {
+/* Returns 1 and stores the value when 'x' fits a long long */
+int lbig_to_int(lbig* x, long long* r) {
+	if (x->size > 2) return 0;
 
-	switch (v->type) {
-	case LVAL_NUM:
-	case LVAL_BOOL:
-		break;
+	unsigned long long u = 0;
+	if (x->size > 0) u = x->limbs[0];
+	if (x->size > 1) u |= (unsigned long long)x->limbs[1] << 32;
 
-	case LVAL_ERR:
-		free(v->err);
-		break;
-	case LVAL_SYM:
-		free(v->sym);
-		break;
-	case LVAL_STR:
-		free(v->str);
-		break;
+	if (x->sign >= 0 && u > (unsigned long long)LLONG_MAX) return 0;
+	if (x->sign < 0 && u > (unsigned long long)LLONG_MAX + 1) return 0;
 
-	case LVAL_FUN:
-		if (!v->builtin) {
-			lenv_del(v->env);
-			lval_del(v->formals);
-			lval_del(v->body);
-		}
-		break;
+	*r = x->sign < 0 ? (long long)(0 - u) : (long long)u;
+	return 1;
+}
 
-	case LVAL_QEXPR:
-	case LVAL_SEXPR: {
-		for (int i = 0; i < v->count; i++) {
-			lval_del(v->cell[i]);
-		}
+double lbig_to_double(lbig* x) {
+	double d = 0;
+	for (int i = x->size - 1; i >= 0; i--) d = d * 4294967296.0 + x->limbs[i];
+	return x->sign < 0 ? -d : d;
+}
 
-		free(v->cell);
-		break;
+/* The top three limbs of 'x' as a double, which is 'x' divided by 2^(32 * '*shift') */
+double lbig_top(lbig* x, long* shift) {
+	int from = x->size > 3 ? x->size - 3 : 0;
+	double d = 0;
+	for (int i = x->size - 1; i >= from; i--) d = d * 4294967296.0 + x->limbs[i];
+	*shift = from;
+	return x->sign < 0 ? -d : d;
+}
+
+/* 'x' / 'y' as a double, scaling both down to their top limbs first so that
+ * neither overflows a double on its own */
+double lbig_ratio(lbig* x, lbig* y) {
+	long sx, sy;
+	double d = lbig_top(x, &sx) / lbig_top(y, &sy);
+	long e = 32 * (sx - sy);
+	return ldexp(d, e > 4096 ? 4096 : e < -4096 ? -4096 : (int)e);
+}
+
+/* In-place operations on an accumulator '*x'. Each returns 0 and leaves '*x'
+ * alone when the result is not an integer */
+int lbig_add(lbig* x, lbig* y) {
+	int n = (x->size > y->size ? x->size : y->size) + 1;
+	lbig r = { .limbs = malloc(sizeof(unsigned) * n) };
+
+	if (x->sign == y->sign || y->sign == 0 || x->sign == 0) {
+		r.sign = x->sign ? x->sign : y->sign;
+		r.size = mag_add(r.limbs, x->limbs, x->size, y->limbs, y->size);
+	}
+	else if (mag_cmp(x->limbs, x->size, y->limbs, y->size) >= 0) {
+		r.sign = x->sign;
+		r.size = mag_sub(r.limbs, x->limbs, x->size, y->limbs, y->size);
 	}
+	else {
+		r.sign = y->sign;
+		r.size = mag_sub(r.limbs, y->limbs, y->size, x->limbs, x->size);
 	}
 
-	free(v);
+	lbig_set(x, r);
+	return 1;
 }
 
-void lenv_del(lenv* e) {
-	for (int i = 0; i < e->count; i++) {
-		free(e->syms[i]);
-		lval_del(e->vals[i]);
-	}
-	free(e->syms);
-	free(e->vals);
-	free(e);
+int lbig_sub(lbig* x, lbig* y) {
+	lbig neg = *y;
+	neg.sign = -neg.sign;
+	return lbig_add(x, &neg);
 }
 
-lenv* lenv_copy(lenv* e) {
-	lenv* n = malloc(sizeof(lenv));
-	n->par = e->par;
-	n->count = e->count;
-	n->syms = malloc(sizeof(char*) * n->count);
-	n->vals = malloc(sizeof(lval*) * n->count);
-	for (int i = 0; i < e->count; i++) {
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(n->syms[i], e->syms[i]);
-		n->vals[i] = lval_copy(e->vals[i]);
-	}
-	return n;
+int lbig_mul(lbig* x, lbig* y) {
+	lbig r = { .sign = x->sign * y->sign, .limbs = malloc(sizeof(unsigned) * (x->size + y->size + 1)) };
+	mag_mul(r.limbs, x->limbs, x->size, y->limbs, y->size);
+	r.size = mag_trim(r.limbs, x->size + y->size);
+	lbig_set(x, r);
+	return 1;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
+/* Truncating division as in C, the remainder takes the sign of the dividend */
+void lbig_divmod(lbig* x, lbig* y, lbig* q, lbig* r) {
+	q->limbs = malloc(sizeof(unsigned) * (x->size + 1));
+	r->limbs = calloc(y->size + 1, sizeof(unsigned));
 
-	for (int i = 0; i < e->count; i++) {
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
-			return;
-		}
+	if (mag_cmp(x->limbs, x->size, y->limbs, y->size) < 0) {
+		memcpy(r->limbs, x->limbs, sizeof(unsigned) * x->size);
+		q->size = 0;
+		r->size = x->size;
+	}
+	else {
+		mag_divmod(q->limbs, &q->size, r->limbs, &r->size, x->limbs, x->size, y->limbs, y->size);
 	}
 
-	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-	e->syms = realloc(e->syms, sizeof(char*) * e->count);
-
-	e->vals[e->count - 1] = lval_copy(v);
-	e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-	strcpy(e->syms[e->count - 1], k->sym);
+	q->sign = q->size ? x->sign * y->sign : 0;
+	r->sign = r->size ? x->sign : 0;
 }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-	while (e->par) e = e->par;
+/* A quotient that is not an integer is stored in '*d' instead, as the exact
+ * integer part plus the remainder's fraction of 'y' */
+int lbig_div(lbig* x, lbig* y, double* d) {
+	lbig q, r;
+	lbig_divmod(x, y, &q, &r);
+
+	int exact = r.size == 0;
+	if (!exact) *d = lbig_to_double(&q) + lbig_ratio(&r, y);
+	lbig_free(&r);
+	if (!exact) {
+		lbig_free(&q);
+		return 0;
+	}
 
-	lenv_put(e, k, v);
+	lbig_set(x, q);
+	return 1;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
+int lbig_mod(lbig* x, lbig* y) {
+	lbig q, r;
+	lbig_divmod(x, y, &q, &r);
+	lbig_free(&q);
+	lbig_set(x, r);
+	return 1;
+}
 
-	for (int i = 0; i < e->count; i++) {
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			return lval_copy(e->vals[i]);
-		}
+/* Binary exponentiation, negative exponents give fractions */
+int lbig_pow(lbig* x, lbig* y) {
+	long long e;
+	if (y->sign < 0 || !lbig_to_int(y, &e)) return 0;
+
+	lbig base = lbig_copy(x);
+	lbig r = lbig_from_int(1);
+	while (e > 0) {
+		if (e & 1) lbig_mul(&r, &base);
+		e >>= 1;
+		if (e > 0) lbig_mul(&base, &base);
 	}
 
-	if (e->par) {
-		return lenv_get(e->par, k);
-	}
-	else {
-		return lval_err("Unbound symbol '%s'", k->sym);
-	}
+	lbig_free(&base);
+	lbig_set(x, r);
+	return 1;
 }
 
-lval* lval_add(lval* v, lval* x) {
-	v->count++;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	v->cell[v->count - 1] = x;
-	return v;
+int lbig_min(lbig* x, lbig* y) {
+	if (lbig_cmp(y, x) < 0) lbig_set(x, lbig_copy(y));
+	return 1;
 }
 
-lval* lval_pop(lval* v, int i) {
-	lval* x = v->cell[i];
+int lbig_max(lbig* x, lbig* y) {
+	if (lbig_cmp(y, x) > 0) lbig_set(x, lbig_copy(y));
+	return 1;
+}
 
-	memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+int max_children(mpc_ast_t* t) {
 
-	v->count--;
+	if (t->children_num == 0) {
+		return 0;
+	}
 
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	return x;
-}
+	// Start by assuming the current node has the maximum children
+	int max_count = t->children_num;
 
-lval* lval_take(lval* v, int i) {
-	lval* x = lval_pop(v, i);
-	lval_del(v);
-	return x;
+	// Recursively check the children
+	for (int i = 0; i < t->children_num; i++) {
+		int child_max = max_children(t->children[i]);
+		if (child_max > max_count) {
+			max_count = child_max;
+		}
+	}
+
+	return max_count;
 }
 
-lval* lval_join(lval* x, lval* y) {
+int countBranches(mpc_ast_t* t) {
+
+	if (t->children_num == 0) return 0;
 
-	while (y->count) {
-		x = lval_add(x, lval_pop(y, 0));
+	int branch_count = 1;
+	for (int i = 0; i < t->children_num; i++) {
+		branch_count = branch_count + countBranches(t->children[i]);
 	}
 
-	lval_del(y);
-	return x;
+	return branch_count;
 }
 
-lval* lval_copy(lval* v) {
+int countLeaves(mpc_ast_t* t) {
 
-	lval* x = malloc(sizeof(lval));
-	x->type = v->type;
+	if (t->children_num == 0) return 1;
 
-	switch (v->type) {
+	int leaf_count = 0;
+	for (int i = 0; i < t->children_num; i++) {
+		leaf_count = leaf_count + countLeaves(t->children[i]);
+	}
 
-	case LVAL_FUN:
-		if (v->builtin) {
-			x->builtin = v->builtin;
-			x->fun_name = v->fun_name;
-		}
-		else {
-			x->builtin = NULL;
-			x->fun_name = v->fun_name;
-			x->env = lenv_copy(v->env);
-			x->formals = lval_copy(v->formals);
-			x->body = lval_copy(v->body);
+	return leaf_count;
+}
+
+/* Numeric Array Kernels */
+
+/*
+ * Elementwise kernels compute r[i] = a[i * as] op b[i * bs], so a step of 0
+ * broadcasts a scalar, and integer kernels return 0 on overflow. The string
+ * builtins' byte scanning lives here too. Each comes in a portable version
+ * and, on x86, in SSE2 and AVX2 versions picked once at startup from what the
+ * CPU supports. Floating point reductions keep one partial result per lane,
+ * so sums may round differently from a plain loop.
+ */
+
+typedef void (*lkernel_f64)(double* r, double* a, int as, double* b, int bs, int n);
+typedef int (*lkernel_i64)(long long* r, long long* a, int as, long long* b, int bs, int n);
+
+typedef struct {
+	lkernel_f64 f64_add;
+	lkernel_f64 f64_sub;
+	lkernel_f64 f64_mul;
+	lkernel_f64 f64_div;
+	double (*f64_sum)(double* a, int n);
+	double (*f64_dot)(double* a, double* b, int n);
+	double (*f64_min)(double* a, int n);
+	double (*f64_max)(double* a, int n);
+	void (*f64_gemm)(double* c, double* a, double* b, int m, int n, int k, int lda, int ldb, int ldc);
+
+	lkernel_i64 i64_add;
+	lkernel_i64 i64_sub;
+	lkernel_i64 i64_mul;
+	int (*i64_sum)(long long* a, int n, long long* r);
+	int (*i64_dot)(long long* a, long long* b, int n, long long* r);
+	long long (*i64_min)(long long* a, int n);
+	long long (*i64_max)(long long* a, int n);
+
+	long (*str_find)(const char* h, long n, const char* s, long m);
+	void (*str_upper)(char* r, const char* s, long n);
+	long (*str_plain)(const char* s, long n);
+} lkernels;
+
+lkernels kernels;
+
+#define LKERNEL_F64(name, op) \
+	void portable_f64_##name(double* r, double* a, int as, double* b, int bs, int n) { \
+		for (int i = 0; i < n; i++) r[i] = a[i * as] op b[i * bs]; \
+	}
+
+LKERNEL_F64(add, +)
+LKERNEL_F64(sub, -)
+LKERNEL_F64(mul, *)
+LKERNEL_F64(div, /)
+
+#define LKERNEL_I64(name) \
+	int portable_i64_##name(long long* r, long long* a, int as, long long* b, int bs, int n) { \
+		for (int i = 0; i < n; i++) { \
+			if (!lint_##name(a[i * as], b[i * bs], &r[i])) return 0; \
+		} \
+		return 1; \
+	}
+
+LKERNEL_I64(add)
+LKERNEL_I64(sub)
+LKERNEL_I64(mul)
+
+double portable_f64_sum(double* a, int n) {
+	double s = 0;
+	for (int i = 0; i < n; i++) s += a[i];
+	return s;
+}
+
+double portable_f64_dot(double* a, double* b, int n) {
+	double s = 0;
+	for (int i = 0; i < n; i++) s += a[i] * b[i];
+	return s;
+}
+
+double portable_f64_min(double* a, int n) {
+	double m = a[0];
+	for (int i = 1; i < n; i++) m = a[i] < m ? a[i] : m;
+	return m;
+}
+
+double portable_f64_max(double* a, int n) {
+	double m = a[0];
+	for (int i = 1; i < n; i++) m = a[i] > m ? a[i] : m;
+	return m;
+}
+
+/* C += A * B for an m x n block of C and a k-long panel, 'ldx' being the row strides */
+void portable_f64_gemm(double* c, double* a, double* b, int m, int n, int k, int lda, int ldb, int ldc) {
+	for (int i = 0; i < m; i++) {
+		for (int l = 0; l < k; l++) {
+			double x = a[i * lda + l];
+			for (int j = 0; j < n; j++) c[i * ldc + j] += x * b[l * ldb + j];
 		}
-		break;
-	case LVAL_NUM:
-		x->num = v->num;
-		break;
-	case LVAL_BOOL:
-		x->bool = v->bool;
+	}
+}
 
-	case LVAL_ERR:
-		x->err = malloc(strlen(v->err) + 1);
-		strcpy(x->err, v->err);
-		break;
+int portable_i64_sum(long long* a, int n, long long* r) {
+	long long hi = 0;
+	unsigned long long lo = 0;
+	for (int i = 0; i < n; i++) {
+		hi += a[i] >> 32;
+		lo += (unsigned long long)a[i] & 0xFFFFFFFFULL;
+	}
+	return lint_join(hi, lo, r);
+}
 
-	case LVAL_SYM:
-		x->sym = malloc(strlen(v->sym) + 1);
-		strcpy(x->sym, v->sym);
-		break;
+/* No x86 extension before AVX-512 multiplies 64-bit lanes, so this one is always scalar */
+int portable_i64_dot(long long* a, long long* b, int n, long long* r) {
+	long long s = 0;
+	for (int i = 0; i < n; i++) {
+		long long p;
+		if (!lint_mul(a[i], b[i], &p) || !lint_add(s, p, &s)) return 0;
+	}
+	*r = s;
+	return 1;
+}
 
-	case LVAL_STR:
-		x->str = malloc(strlen(v->str) + 1);
-		strcpy(x->str, v->str);
-		break;
+long long portable_i64_min(long long* a, int n) {
+	long long m = a[0];
+	for (int i = 1; i < n; i++) m = a[i] < m ? a[i] : m;
+	return m;
+}
 
-	case LVAL_SEXPR:
-	case LVAL_QEXPR: {
-		x->count = v->count;
-		x->cell = malloc(sizeof(lval*) * x->count);
-		for (int i = 0; i < x->count; i++) {
-			x->cell[i] = lval_copy(v->cell[i]);
+long long portable_i64_max(long long* a, int n) {
+	long long m = a[0];
+	for (int i = 1; i < n; i++) m = a[i] > m ? a[i] : m;
+	return m;
+}
+
+/* Index of the first 's' of 'm' > 0 bytes in 'h' of 'n' bytes, or -1. memchr is
+ * vectorized by the C library, so this hops between first-byte matches */
+long portable_str_find(const char* h, long n, const char* s, long m) {
+	long i = 0;
+	while (i + m <= n) {
+		const char* c = memchr(h + i, s[0], n - m + 1 - i);
+		if (!c) return -1;
+		i = c - h;
+		if (memcmp(c + 1, s + 1, m - 1) == 0) return i;
+		i++;
+	}
+	return -1;
+}
+
+/* ASCII letters only, other bytes are copied unchanged */
+void portable_str_upper(char* r, const char* s, long n) {
+	for (long i = 0; i < n; i++) r[i] = s[i] >= 'a' && s[i] <= 'z' ? s[i] - ('a' - 'A') : s[i];
+}
+
+/* Length of the run at the start of 's' that prints without escaping. Every
+ * byte below 14 ends the run, a superset of the control characters escaped */
+#define LSTR_PLAIN(c) ((unsigned char)(c) > 13 && (c) != '"' && (c) != '\'' && (c) != '\\')
+
+long portable_str_plain(const char* s, long n) {
+	long i = 0;
+	while (i < n && LSTR_PLAIN(s[i])) i++;
+	return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LKERNELS_X86
+
+/* 'p' is the intrinsic prefix (_mm or _mm256) and 'si' names its integer vector type */
+#define LKERNEL_F64_SIMD(isa, feature, vec, width, p, name, op) \
+	__attribute__((target(feature))) \
+	void isa##_f64_##name(double* r, double* a, int as, double* b, int bs, int n) { \
+		if (n == 0) return; \
+		vec va = p##_set1_pd(a[0]); \
+		vec vb = p##_set1_pd(b[0]); \
+		int i = 0; \
+		for (; i + width <= n; i += width) { \
+			vec x = as ? p##_loadu_pd(a + i) : va; \
+			vec y = bs ? p##_loadu_pd(b + i) : vb; \
+			p##_storeu_pd(r + i, p##_##name##_pd(x, y)); \
+		} \
+		for (; i < n; i++) r[i] = a[i * as] op b[i * bs]; \
+	}
+
+/* Signed overflow shows in the sign bit: for x + y when the result's sign
+ * differs from both operands', for x - y when it differs from x and x's
+ * sign differs from y's */
+#define LKERNEL_I64_SIMD(isa, feature, vec, width, p, si, name, is_add) \
+	__attribute__((target(feature))) \
+	int isa##_i64_##name(long long* r, long long* a, int as, long long* b, int bs, int n) { \
+		if (n == 0) return 1; \
+		vec va = p##_set1_epi64x(a[0]); \
+		vec vb = p##_set1_epi64x(b[0]); \
+		vec bad = p##_setzero_##si(); \
+		int i = 0; \
+		for (; i + width <= n; i += width) { \
+			vec x = as ? p##_loadu_##si((vec*)(a + i)) : va; \
+			vec y = bs ? p##_loadu_##si((vec*)(b + i)) : vb; \
+			vec z = p##_##name##_epi64(x, y); \
+			vec o = is_add \
+				? p##_and_##si(p##_xor_##si(x, z), p##_xor_##si(y, z)) \
+				: p##_and_##si(p##_xor_##si(x, y), p##_xor_##si(x, z)); \
+			bad = p##_or_##si(bad, o); \
+			p##_storeu_##si((vec*)(r + i), z); \
+		} \
+		if (p##_movemask_pd(p##_cast##si##_pd(bad))) return 0; \
+		for (; i < n; i++) { \
+			if (!lint_##name(a[i * as], b[i * bs], &r[i])) return 0; \
+		} \
+		return 1; \
+	}
+
+#define LKERNEL_REDUCE_SIMD(isa, feature, fvec, ivec, width, p, si) \
+	__attribute__((target(feature))) \
+	double isa##_f64_sum(double* a, int n) { \
+		fvec s = p##_setzero_pd(); \
+		int i = 0; \
+		for (; i + width <= n; i += width) s = p##_add_pd(s, p##_loadu_pd(a + i)); \
+		double lanes[width]; \
+		p##_storeu_pd(lanes, s); \
+		double r = 0; \
+		for (int j = 0; j < width; j++) r += lanes[j]; \
+		for (; i < n; i++) r += a[i]; \
+		return r; \
+	} \
+	__attribute__((target(feature))) \
+	double isa##_f64_dot(double* a, double* b, int n) { \
+		fvec s = p##_setzero_pd(); \
+		int i = 0; \
+		for (; i + width <= n; i += width) { \
+			s = p##_add_pd(s, p##_mul_pd(p##_loadu_pd(a + i), p##_loadu_pd(b + i))); \
+		} \
+		double lanes[width]; \
+		p##_storeu_pd(lanes, s); \
+		double r = 0; \
+		for (int j = 0; j < width; j++) r += lanes[j]; \
+		for (; i < n; i++) r += a[i] * b[i]; \
+		return r; \
+	} \
+	__attribute__((target(feature))) \
+	double isa##_f64_min(double* a, int n) { \
+		fvec m = p##_set1_pd(a[0]); \
+		int i = 0; \
+		for (; i + width <= n; i += width) m = p##_min_pd(m, p##_loadu_pd(a + i)); \
+		double lanes[width]; \
+		p##_storeu_pd(lanes, m); \
+		double r = lanes[0]; \
+		for (int j = 1; j < width; j++) r = lanes[j] < r ? lanes[j] : r; \
+		for (; i < n; i++) r = a[i] < r ? a[i] : r; \
+		return r; \
+	} \
+	__attribute__((target(feature))) \
+	double isa##_f64_max(double* a, int n) { \
+		fvec m = p##_set1_pd(a[0]); \
+		int i = 0; \
+		for (; i + width <= n; i += width) m = p##_max_pd(m, p##_loadu_pd(a + i)); \
+		double lanes[width]; \
+		p##_storeu_pd(lanes, m); \
+		double r = lanes[0]; \
+		for (int j = 1; j < width; j++) r = lanes[j] > r ? lanes[j] : r; \
+		for (; i < n; i++) r = a[i] > r ? a[i] : r; \
+		return r; \
+	} \
+	__attribute__((target(feature))) \
+	int isa##_i64_sum(long long* a, int n, long long* r) { \
+		ivec hs = p##_setzero_##si(); \
+		ivec ls = p##_setzero_##si(); \
+		ivec low = p##_set1_epi64x(0xFFFFFFFFLL); \
+		ivec sign = p##_set1_epi64x(0x80000000LL); \
+		int i = 0; \
+		for (; i + width <= n; i += width) { \
+			ivec x = p##_loadu_##si((ivec*)(a + i)); \
+			/* No 64-bit arithmetic shift before AVX-512, so sign extend by hand */ \
+			ivec h = p##_sub_epi64(p##_xor_##si(p##_srli_epi64(x, 32), sign), sign); \
+			hs = p##_add_epi64(hs, h); \
+			ls = p##_add_epi64(ls, p##_and_##si(x, low)); \
+		} \
+		long long hl[width]; \
+		unsigned long long ll[width]; \
+		p##_storeu_##si((ivec*)hl, hs); \
+		p##_storeu_##si((ivec*)ll, ls); \
+		long long hi = 0; \
+		unsigned long long lo = 0; \
+		for (int j = 0; j < width; j++) { \
+			hi += hl[j]; \
+			lo += ll[j]; \
+		} \
+		for (; i < n; i++) { \
+			hi += a[i] >> 32; \
+			lo += (unsigned long long)a[i] & 0xFFFFFFFFULL; \
+		} \
+		return lint_join(hi, lo, r); \
+	}
+
+/* Each step of the micro-kernel keeps a 4 x 2-vector tile of C in registers
+ * across the whole panel, loading a row of B once for four rows of A. The
+ * ragged edges go to the portable kernel */
+#define LKERNEL_GEMM_SIMD(isa, feature, fvec, width, p) \
+	__attribute__((target(feature))) \
+	void isa##_f64_gemm(double* c, double* a, double* b, int m, int n, int k, int lda, int ldb, int ldc) { \
+		int i = 0; \
+		for (; i + 4 <= m; i += 4) { \
+			double* c0 = c + i * ldc; \
+			double* c1 = c0 + ldc; \
+			double* c2 = c1 + ldc; \
+			double* c3 = c2 + ldc; \
+			double* a0 = a + i * lda; \
+			double* a1 = a0 + lda; \
+			double* a2 = a1 + lda; \
+			double* a3 = a2 + lda; \
+			int j = 0; \
+			for (; j + 2 * width <= n; j += 2 * width) { \
+				fvec t00 = p##_loadu_pd(c0 + j), t01 = p##_loadu_pd(c0 + j + width); \
+				fvec t10 = p##_loadu_pd(c1 + j), t11 = p##_loadu_pd(c1 + j + width); \
+				fvec t20 = p##_loadu_pd(c2 + j), t21 = p##_loadu_pd(c2 + j + width); \
+				fvec t30 = p##_loadu_pd(c3 + j), t31 = p##_loadu_pd(c3 + j + width); \
+				for (int l = 0; l < k; l++) { \
+					fvec b0 = p##_loadu_pd(b + l * ldb + j); \
+					fvec b1 = p##_loadu_pd(b + l * ldb + j + width); \
+					fvec x = p##_set1_pd(a0[l]); \
+					t00 = p##_add_pd(t00, p##_mul_pd(x, b0)); \
+					t01 = p##_add_pd(t01, p##_mul_pd(x, b1)); \
+					x = p##_set1_pd(a1[l]); \
+					t10 = p##_add_pd(t10, p##_mul_pd(x, b0)); \
+					t11 = p##_add_pd(t11, p##_mul_pd(x, b1)); \
+					x = p##_set1_pd(a2[l]); \
+					t20 = p##_add_pd(t20, p##_mul_pd(x, b0)); \
+					t21 = p##_add_pd(t21, p##_mul_pd(x, b1)); \
+					x = p##_set1_pd(a3[l]); \
+					t30 = p##_add_pd(t30, p##_mul_pd(x, b0)); \
+					t31 = p##_add_pd(t31, p##_mul_pd(x, b1)); \
+				} \
+				p##_storeu_pd(c0 + j, t00); p##_storeu_pd(c0 + j + width, t01); \
+				p##_storeu_pd(c1 + j, t10); p##_storeu_pd(c1 + j + width, t11); \
+				p##_storeu_pd(c2 + j, t20); p##_storeu_pd(c2 + j + width, t21); \
+				p##_storeu_pd(c3 + j, t30); p##_storeu_pd(c3 + j + width, t31); \
+			} \
+			portable_f64_gemm(c0 + j, a0, b + j, 4, n - j, k, lda, ldb, ldc); \
+		} \
+		portable_f64_gemm(c + i * ldc, a + i * lda, b, m - i, n, k, lda, ldb, ldc); \
+	}
+
+#define LKERNELS_SIMD(isa, feature, fvec, ivec, width, p, si) \
+	LKERNEL_F64_SIMD(isa, feature, fvec, width, p, add, +) \
+	LKERNEL_F64_SIMD(isa, feature, fvec, width, p, sub, -) \
+	LKERNEL_F64_SIMD(isa, feature, fvec, width, p, mul, *) \
+	LKERNEL_F64_SIMD(isa, feature, fvec, width, p, div, /) \
+	LKERNEL_I64_SIMD(isa, feature, ivec, width, p, si, add, 1) \
+	LKERNEL_I64_SIMD(isa, feature, ivec, width, p, si, sub, 0) \
+	LKERNEL_REDUCE_SIMD(isa, feature, fvec, ivec, width, p, si) \
+	LKERNEL_GEMM_SIMD(isa, feature, fvec, width, p)
+
+LKERNELS_SIMD(sse2, "sse2", __m128d, __m128i, 2, _mm, si128)
+LKERNELS_SIMD(avx2, "avx2", __m256d, __m256i, 4, _mm256, si256)
+
+/* 64-bit lane comparisons only arrived with SSE4.2 and AVX2 */
+#define LKERNEL_I64_ORD_AVX2(name, op, pick) \
+	__attribute__((target("avx2"))) \
+	long long avx2_i64_##name(long long* a, int n) { \
+		__m256i m = _mm256_set1_epi64x(a[0]); \
+		int i = 0; \
+		for (; i + 4 <= n; i += 4) { \
+			__m256i x = _mm256_loadu_si256((__m256i*)(a + i)); \
+			m = _mm256_blendv_epi8(m, x, pick); \
+		} \
+		long long lanes[4]; \
+		_mm256_storeu_si256((__m256i*)lanes, m); \
+		long long r = lanes[0]; \
+		for (int j = 1; j < 4; j++) r = lanes[j] op r ? lanes[j] : r; \
+		for (; i < n; i++) r = a[i] op r ? a[i] : r; \
+		return r; \
+	}
+
+LKERNEL_I64_ORD_AVX2(min, <, _mm256_cmpgt_epi64(m, x))
+LKERNEL_I64_ORD_AVX2(max, >, _mm256_cmpgt_epi64(x, m))
+
+/* Candidates are the positions where both the first and the last byte of the
+ * needle match, found a whole vector at a time; only those are compared in full */
+#define LKERNEL_FIND_SIMD(isa, feature, vec, width, p, si) \
+	__attribute__((target(feature))) \
+	long isa##_str_find(const char* h, long n, const char* s, long m) { \
+		vec first = p##_set1_epi8(s[0]); \
+		vec last = p##_set1_epi8(s[m - 1]); \
+		long i = 0; \
+		for (; i + m - 1 + width <= n; i += width) { \
+			vec x = p##_loadu_##si((vec*)(h + i)); \
+			vec y = p##_loadu_##si((vec*)(h + i + m - 1)); \
+			unsigned hits = p##_movemask_epi8(p##_and_##si(p##_cmpeq_epi8(x, first), p##_cmpeq_epi8(y, last))); \
+			while (hits) { \
+				int j = __builtin_ctz(hits); \
+				if (m < 3 || memcmp(h + i + j + 1, s + 1, m - 2) == 0) return i + j; \
+				hits &= hits - 1; \
+			} \
+		} \
+		long r = portable_str_find(h + i, n - i, s, m); \
+		return r < 0 ? r : i + r; \
+	}
+
+/* Bytes above 'a' - 1 and below 'z' + 1 as signed bytes are exactly the lowercase letters */
+#define LKERNEL_UPPER_SIMD(isa, feature, vec, width, p, si) \
+	__attribute__((target(feature))) \
+	void isa##_str_upper(char* r, const char* s, long n) { \
+		vec lo = p##_set1_epi8('a' - 1); \
+		vec hi = p##_set1_epi8('z' + 1); \
+		vec d = p##_set1_epi8('a' - 'A'); \
+		long i = 0; \
+		for (; i + width <= n; i += width) { \
+			vec x = p##_loadu_##si((vec*)(s + i)); \
+			vec is_lower = p##_and_##si(p##_cmpgt_epi8(x, lo), p##_cmpgt_epi8(hi, x)); \
+			p##_storeu_##si((vec*)(r + i), p##_sub_epi8(x, p##_and_##si(is_lower, d))); \
+		} \
+		portable_str_upper(r + i, s + i, n - i); \
+	}
+
+/* An unsigned byte is at most 13 exactly when the unsigned minimum leaves it unchanged */
+#define LKERNEL_PLAIN_SIMD(isa, feature, vec, width, p, si) \
+	__attribute__((target(feature))) \
+	long isa##_str_plain(const char* s, long n) { \
+		vec ctrl = p##_set1_epi8(13); \
+		vec dq = p##_set1_epi8('"'); \
+		vec sq = p##_set1_epi8('\''); \
+		vec bs = p##_set1_epi8('\\'); \
+		long i = 0; \
+		for (; i + width <= n; i += width) { \
+			vec x = p##_loadu_##si((vec*)(s + i)); \
+			vec stop = p##_or_##si( \
+				p##_or_##si(p##_cmpeq_epi8(p##_min_epu8(x, ctrl), x), p##_cmpeq_epi8(x, dq)), \
+				p##_or_##si(p##_cmpeq_epi8(x, sq), p##_cmpeq_epi8(x, bs))); \
+			unsigned hits = p##_movemask_epi8(stop); \
+			if (hits) return i + __builtin_ctz(hits); \
+		} \
+		return i + portable_str_plain(s + i, n - i); \
+	}
+
+LKERNEL_FIND_SIMD(sse2, "sse2", __m128i, 16, _mm, si128)
+LKERNEL_FIND_SIMD(avx2, "avx2", __m256i, 32, _mm256, si256)
+LKERNEL_UPPER_SIMD(sse2, "sse2", __m128i, 16, _mm, si128)
+LKERNEL_UPPER_SIMD(avx2, "avx2", __m256i, 32, _mm256, si256)
+LKERNEL_PLAIN_SIMD(sse2, "sse2", __m128i, 16, _mm, si128)
+LKERNEL_PLAIN_SIMD(avx2, "avx2", __m256i, 32, _mm256, si256)
+#endif
+
+void lkernels_init(void) {
+	kernels = (lkernels){
+		portable_f64_add, portable_f64_sub, portable_f64_mul, portable_f64_div,
+		portable_f64_sum, portable_f64_dot, portable_f64_min, portable_f64_max, portable_f64_gemm,
+		portable_i64_add, portable_i64_sub, portable_i64_mul,
+		portable_i64_sum, portable_i64_dot, portable_i64_min, portable_i64_max,
+		portable_str_find, portable_str_upper, portable_str_plain
+	};
+
+#ifdef LKERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		kernels.f64_add = sse2_f64_add;
+		kernels.f64_sub = sse2_f64_sub;
+		kernels.f64_mul = sse2_f64_mul;
+		kernels.f64_div = sse2_f64_div;
+		kernels.f64_sum = sse2_f64_sum;
+		kernels.f64_dot = sse2_f64_dot;
+		kernels.f64_min = sse2_f64_min;
+		kernels.f64_max = sse2_f64_max;
+		kernels.f64_gemm = sse2_f64_gemm;
+		kernels.i64_add = sse2_i64_add;
+		kernels.i64_sub = sse2_i64_sub;
+		kernels.i64_sum = sse2_i64_sum;
+		kernels.str_find = sse2_str_find;
+		kernels.str_upper = sse2_str_upper;
+		kernels.str_plain = sse2_str_plain;
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.f64_add = avx2_f64_add;
+		kernels.f64_sub = avx2_f64_sub;
+		kernels.f64_mul = avx2_f64_mul;
+		kernels.f64_div = avx2_f64_div;
+		kernels.f64_sum = avx2_f64_sum;
+		kernels.f64_dot = avx2_f64_dot;
+		kernels.f64_min = avx2_f64_min;
+		kernels.f64_max = avx2_f64_max;
+		kernels.f64_gemm = avx2_f64_gemm;
+		kernels.i64_add = avx2_i64_add;
+		kernels.i64_sub = avx2_i64_sub;
+		kernels.i64_sum = avx2_i64_sum;
+		kernels.i64_min = avx2_i64_min;
+		kernels.i64_max = avx2_i64_max;
+		kernels.str_find = avx2_str_find;
+		kernels.str_upper = avx2_str_upper;
+		kernels.str_plain = avx2_str_plain;
+	}
+#endif
+}
+
+/* Matrix Kernels */
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#define LGEMM_THREADS
+#endif
+
+/* Blocks of A (MC x KC) and panels of B (KC x NC) sized to stay in cache
+ * while the micro-kernel sweeps them */
+#define GEMM_MC 64
+#define GEMM_KC 256
+#define GEMM_NC 1024
+
+/* Products below this many multiply-adds are not worth starting threads for */
+#define GEMM_PARALLEL_MIN (1 << 21)
+#define GEMM_MAX_THREADS 16
+
+typedef struct {
+	double* c;
+	double* a;
+	double* b;
+	int m;
+	int n;
+	int k;
+} lgemm;
+
+/* C = A * B for row-major A (m x k) and B (k x n), C starting zeroed */
+void lgemm_blocked(lgemm* g) {
+	for (int jj = 0; jj < g->n; jj += GEMM_NC) {
+		int nc = g->n - jj < GEMM_NC ? g->n - jj : GEMM_NC;
+		for (int kk = 0; kk < g->k; kk += GEMM_KC) {
+			int kc = g->k - kk < GEMM_KC ? g->k - kk : GEMM_KC;
+			for (int ii = 0; ii < g->m; ii += GEMM_MC) {
+				int mc = g->m - ii < GEMM_MC ? g->m - ii : GEMM_MC;
+				kernels.f64_gemm(g->c + ii * g->n + jj, g->a + ii * g->k + kk, g->b + kk * g->n + jj,
+					mc, nc, kc, g->k, g->n, g->n);
+			}
 		}
+	}
+}
 
-		break;
+#ifdef LGEMM_THREADS
+void* lgemm_thread(void* g) {
+	lgemm_blocked(g);
+	return NULL;
+}
+#endif
+
+/* Large products split the rows of C between threads, each running the
+ * blocked loops on its own band */
+void lmat_mul(double* c, double* a, double* b, int m, int n, int k) {
+	memset(c, 0, sizeof(double) * m * n);
+
+	int threads = 1;
+#ifdef LGEMM_THREADS
+	if ((double)m * n * k >= GEMM_PARALLEL_MIN) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus < 1 ? 1 : cpus > GEMM_MAX_THREADS ? GEMM_MAX_THREADS : cpus;
+		if (threads > m / 4) threads = m / 4 ? m / 4 : 1;
+	}
+#endif
+
+	/* Bands are a multiple of four rows so each fills whole micro-kernel tiles */
+	int band = ((m + threads - 1) / threads + 3) / 4 * 4;
+	lgemm parts[GEMM_MAX_THREADS];
+	int count = 0;
+	for (int i = 0; i < m; i += band) {
+		int rows = m - i < band ? m - i : band;
+		parts[count++] = (lgemm){ c + i * n, a + i * k, b, rows, n, k };
+	}
+
+#ifdef LGEMM_THREADS
+	pthread_t ids[GEMM_MAX_THREADS];
+	int started = 0;
+	for (int t = 1; t < count; t++) {
+		if (pthread_create(&ids[t], NULL, lgemm_thread, &parts[t]) != 0) break;
+		started = t;
+	}
+	if (count) lgemm_blocked(&parts[0]);
+	for (int t = 1; t <= started; t++) pthread_join(ids[t], NULL);
+	for (int t = started + 1; t < count; t++) lgemm_blocked(&parts[t]);
+#else
+	for (int t = 0; t < count; t++) lgemm_blocked(&parts[t]);
+#endif
+}
+
+/* Square tiles keep both the rows read and the columns written in cache */
+#define TRANSPOSE_TILE 32
+
+/* Elements of either kind are moved as 8 bytes through memcpy, which reads
+ * doubles without going through a long long pointer */
+void lmat_transpose(void* r, void* a, int rows, int cols) {
+	char* rp = r;
+	char* ap = a;
+	for (int ii = 0; ii < rows; ii += TRANSPOSE_TILE) {
+		int ie = rows - ii < TRANSPOSE_TILE ? rows : ii + TRANSPOSE_TILE;
+		for (int jj = 0; jj < cols; jj += TRANSPOSE_TILE) {
+			int je = cols - jj < TRANSPOSE_TILE ? cols : jj + TRANSPOSE_TILE;
+			for (int i = ii; i < ie; i++) {
+				for (int j = jj; j < je; j++) {
+					memcpy(rp + ((size_t)j * rows + i) * 8, ap + ((size_t)i * cols + j) * 8, 8);
+				}
+			}
+		}
 	}
+}
+
+/* Slab Allocation */
+
+/* lval and lenv are small fixed-size objects, so each type gets its own pool
+ * carved out of slabs and recycled through an intrusive free list */
+#define SLAB_OBJECTS 512
+
+typedef struct lslab {
+	struct lslab* next;
+} lslab;
+
+typedef struct {
+	size_t size;
+	void* free_list;
+	lslab* slabs;
+	long slab_count;
+	long live;
+	long allocs;
+} lpool;
+
+lpool lval_pool = { .size = sizeof(lval) };
+lpool lenv_pool = { .size = sizeof(lenv) };
+
+void pool_grow(lpool* p) {
+	/* Objects follow the header, aligned as malloc would align them */
+	size_t header = (sizeof(lslab) + 15) & ~(size_t)15;
+	size_t size = (p->size + 15) & ~(size_t)15;
+
+	lslab* slab = malloc(header + size * SLAB_OBJECTS);
+	slab->next = p->slabs;
+	p->slabs = slab;
+	p->slab_count++;
+
+	char* objects = (char*)slab + header;
+	for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+		void* x = objects + size * i;
+		*(void**)x = p->free_list;
+		p->free_list = x;
 	}
+}
+
+void* pool_alloc(lpool* p) {
+	if (!p->free_list) pool_grow(p);
 
+	void* x = p->free_list;
+	p->free_list = *(void**)x;
+	p->live++;
+	p->allocs++;
 	return x;
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-	putchar(open);
-	for (int i = 0; i < v->count; i++) {
+void pool_free(lpool* p, void* x) {
+	*(void**)x = p->free_list;
+	p->free_list = x;
+	p->live--;
+}
 
-		lval_print(v->cell[i]);
+long pool_bytes(lpool* p) {
+	return p->slab_count * SLAB_OBJECTS * (long)((p->size + 15) & ~(size_t)15);
+}
 
-		if (i != (v->count - 1)) putchar(' ');
+double pool_utilization(lpool* p) {
+	if (!p->slab_count) return 0.0;
+	return 100.0 * p->live / (p->slab_count * SLAB_OBJECTS);
+}
+
+void pool_cleanup(lpool* p) {
+	while (p->slabs) {
+		lslab* next = p->slabs->next;
+		free(p->slabs);
+		p->slabs = next;
 	}
-	putchar(close);
+	p->free_list = NULL;
+	p->slab_count = 0;
 }
 
-void lval_print_str(lval* v) {
-	char* escaped = malloc(strlen(v->str) + 1);
-	strcpy(escaped, v->str);
+/* Garbage Collection */
+
+/*
+ * Reference counts free acyclic garbage immediately; the collector traces the
+ * objects that can form cycles (lists and their cell buffers, collections and
+ * their trie nodes, functions and environments) and frees whatever is only
+ * reachable from itself. Roots are found by trial deletion: any object with
+ * more references than the heap itself accounts for is held from outside (the
+ * global environment, the evaluator's C stack, arguments in flight), so no
+ * explicit root registration is needed.
+ */
+
+enum { GC_VAL, GC_ENV, GC_CELLS, GC_NODE };
+
+typedef struct {
+	int kind;
+	void* ptr;
+} lgcobj;
 
-	escaped = mpcf_escape(escaped);
-	printf("\"%s\"", escaped);
+typedef struct {
+	int count;
+	int capacity;
+	lgcobj* objects;
+
+	int* gc_refs;
+	char* marks;
+	int* stack;
+	int stack_count;
+
+	int threshold;
+
+	long collections;
+	long freed;
+	double pause_last;
+	double pause_total;
+	double pause_max;
+} lgc;
+
+lgc gc = { .threshold = 10000 };
+
+void lval_del(lval* v);
+void lcells_del(lcells* b);
+void lhash_del(lhash* h);
+void lnode_del(lnode* n);
+int lnode_is_child(lnode* n, int i);
+void lhash_clear(lhash* h);
+lhash* lhash_copy(lhash* h);
+
+int gc_tracks(int type) {
+	return type == LVAL_FUN || type == LVAL_SEXPR || type == LVAL_QEXPR || type == LVAL_VEC
+		|| type == LVAL_MAP || type == LVAL_SET || type == LVAL_PVEC || type == LVAL_PMAP || type == LVAL_REC
+		|| type == LVAL_BOX;
+}
+
+int gc_track(void* ptr, int kind) {
+	if (gc.count == gc.capacity) {
+		gc.capacity = gc.capacity ? gc.capacity * 2 : 1024;
+		gc.objects = realloc(gc.objects, sizeof(lgcobj) * gc.capacity);
+	}
 
-	free(escaped);
+	gc.objects[gc.count].kind = kind;
+	gc.objects[gc.count].ptr = ptr;
+	return gc.count++;
 }
 
-void lval_print(lval* v) {
+void gc_untrack(int slot) {
+	gc.count--;
+	if (slot == gc.count) return;
+
+	gc.objects[slot] = gc.objects[gc.count];
+	switch (gc.objects[slot].kind) {
+	case GC_VAL: ((lval*)gc.objects[slot].ptr)->gc_slot = slot; break;
+	case GC_ENV: ((lenv*)gc.objects[slot].ptr)->gc_slot = slot; break;
+	case GC_CELLS: ((lcells*)gc.objects[slot].ptr)->gc_slot = slot; break;
+	case GC_NODE: ((lnode*)gc.objects[slot].ptr)->gc_slot = slot; break;
+	}
+}
 
+/* Where the reference count of a tracked object of any kind lives */
+int* gc_refs_of(lgcobj o) {
+	switch (o.kind) {
+	case GC_ENV: return &((lenv*)o.ptr)->refs;
+	case GC_CELLS: return &((lcells*)o.ptr)->refs;
+	case GC_NODE: return &((lnode*)o.ptr)->refs;
+	default: return &((lval*)o.ptr)->refs;
+	}
+}
+
+/* Calls 'visit' with the slot of every tracked object 'o' holds a reference to */
+void gc_each_ref(lgcobj o, void (*visit)(int)) {
+
+	if (o.kind == GC_CELLS) {
+		lcells* b = o.ptr;
+		for (int i = b->lo; i < b->hi; i++) {
+			if (b->slots[i]->gc_slot != -1) visit(b->slots[i]->gc_slot);
+		}
+		return;
+	}
+
+	if (o.kind == GC_NODE) {
+		lnode* n = o.ptr;
+		int slots = n->kind >= LNODE_MAP ? n->count * 2 : n->count;
+		for (int i = 0; i < slots; i++) {
+			if (lnode_is_child(n, i)) visit(((lnode*)n->slots[i])->gc_slot);
+			else if (n->slots[i] && ((lval*)n->slots[i])->gc_slot != -1) visit(((lval*)n->slots[i])->gc_slot);
+		}
+		return;
+	}
+
+	if (o.kind == GC_ENV) {
+		lenv* e = o.ptr;
+		if (e->par) visit(e->par->gc_slot);
+		if (e->layout) visit(e->layout->gc_slot);
+		for (int i = 0; i < e->count; i++) {
+			if (e->vals[i]->gc_slot != -1) visit(e->vals[i]->gc_slot);
+		}
+		return;
+	}
+
+	lval* v = o.ptr;
 	switch (v->type) {
-	case LVAL_NUM:
-		printf("%.2f", v->num);
+	case LVAL_FUN:
+		if (!v->builtin) {
+			visit(v->env->gc_slot);
+			visit(v->formals->gc_slot);
+			visit(v->body->gc_slot);
+		}
+		else if (v->body && v->body->gc_slot != -1) visit(v->body->gc_slot);
 		break;
-	case LVAL_BOOL:
-		printf("%s", v->bool ? "true" : "false");
+	case LVAL_REC:
+		visit(v->rtype->gc_slot);
+		for (int i = 1; i < v->rtype->count; i++) {
+			if (v->fields[i - 1]->gc_slot != -1) visit(v->fields[i - 1]->gc_slot);
+		}
 		break;
-	case LVAL_ERR:
-		printf("Error: %s", v->err);
+	case LVAL_BOX:
+		if (v->boxed && v->boxed->gc_slot != -1) visit(v->boxed->gc_slot);
 		break;
-	case LVAL_SYM:
-		printf("%s", v->sym);
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+	case LVAL_VEC:
+		if (v->cells) visit(v->cells->gc_slot);
 		break;
-	case LVAL_STR:
-		lval_print_str(v);
+	case LVAL_MAP:
+	case LVAL_SET:
+		for (int i = 0; i < v->hash->used; i++) {
+			lval* k = v->hash->keys[i];
+			if (k && k->gc_slot != -1) visit(k->gc_slot);
+			if (k && v->hash->is_map && v->hash->vals[i]->gc_slot != -1) visit(v->hash->vals[i]->gc_slot);
+		}
 		break;
+	case LVAL_PVEC:
+	case LVAL_PMAP:
+		if (v->trie.root) visit(v->trie.root->gc_slot);
+		if (v->trie.tail) visit(v->trie.tail->gc_slot);
+		break;
+	}
+}
+
+void gc_unref(int slot) {
+	gc.gc_refs[slot]--;
+}
+
+void gc_mark(int slot) {
+	if (gc.marks[slot]) return;
+	gc.marks[slot] = 1;
+	gc.stack[gc.stack_count++] = slot;
+}
+
+/* Drops every reference held by a garbage object, leaving an empty shell */
+void gc_clear(lgcobj o) {
+
+	if (o.kind == GC_CELLS) {
+		lcells* b = o.ptr;
+		for (int i = b->lo; i < b->hi; i++) {
+			lval_del(b->slots[i]);
+		}
+		b->hi = b->lo;
+		return;
+	}
+
+	if (o.kind == GC_NODE) {
+		lnode* n = o.ptr;
+		int slots = n->kind >= LNODE_MAP ? n->count * 2 : n->count;
+		for (int i = 0; i < slots; i++) {
+			if (lnode_is_child(n, i)) lnode_del(n->slots[i]);
+			else if (n->slots[i]) lval_del(n->slots[i]);
+		}
+		n->count = 0;
+		return;
+	}
+
+	if (o.kind == GC_ENV) {
+		lenv* e = o.ptr;
+		if (e->par) lenv_del(e->par);
+		e->par = NULL;
+		if (e->layout) lval_del(e->layout);
+		e->layout = NULL;
+		for (int i = 0; i < e->count; i++) {
+			lval_del(e->vals[i]);
+		}
+		e->count = 0;
+		return;
+	}
+
+	lval* v = o.ptr;
+	switch (v->type) {
 	case LVAL_FUN:
-		if (v->builtin) {
-			printf("<function> %s", v->fun_name);
+		if (!v->builtin) {
+			lenv_del(v->env);
+			lval_del(v->formals);
+			lval_del(v->body);
 		}
-		else {
-			printf("<function> %s ", v->fun_name);
-			printf("(\\ ");
-			lval_print(v->formals);
-			putchar(' ');
-			lval_print(v->body);
-			putchar(')');
+		else if (v->body) lval_del(v->body);
+		free(v->fun_name);
+		break;
+	case LVAL_REC:
+		for (int i = 1; i < v->rtype->count; i++) {
+			lval_del(v->fields[i - 1]);
 		}
+		free(v->fields);
+		lval_del(v->rtype);
 		break;
-	case LVAL_SEXPR:
-		lval_expr_print(v, '(', ')');
+	case LVAL_BOX:
+		if (v->boxed) lval_del(v->boxed);
 		break;
+	case LVAL_SEXPR:
 	case LVAL_QEXPR:
-		lval_expr_print(v, '{', '}');
+	case LVAL_VEC:
+		if (v->cells) lcells_del(v->cells);
+		if (v->code) lcode_del(v->code);
+		break;
+	case LVAL_MAP:
+	case LVAL_SET:
+		lhash_clear(v->hash);
+		break;
+	case LVAL_PVEC:
+	case LVAL_PMAP:
+		if (v->trie.root) lnode_del(v->trie.root);
+		if (v->trie.tail) lnode_del(v->trie.tail);
+		v->trie.root = NULL;
+		v->trie.tail = NULL;
+		v->trie.count = 0;
 		break;
 	}
+
+	if (v->type == LVAL_MAP || v->type == LVAL_SET || v->type == LVAL_PVEC || v->type == LVAL_PMAP) return;
+
+	v->type = LVAL_SEXPR;
+	v->count = 0;
+	v->cell = NULL;
+	v->code = NULL;
+	v->cells = NULL;
+}
+
+void gc_collect(void) {
+	clock_t start = clock();
+
+	int n = gc.count;
+	gc.gc_refs = realloc(gc.gc_refs, sizeof(int) * (n + 1));
+	gc.marks = realloc(gc.marks, n + 1);
+	gc.stack = realloc(gc.stack, sizeof(int) * (n + 1));
+
+	/* Subtract references coming from inside the heap */
+	for (int i = 0; i < n; i++) {
+		lgcobj o = gc.objects[i];
+		gc.gc_refs[i] = *gc_refs_of(o);
+		gc.marks[i] = 0;
+	}
+	for (int i = 0; i < n; i++) {
+		gc_each_ref(gc.objects[i], gc_unref);
+	}
+
+	/* Whatever is left over is referenced from outside, so trace from there */
+	gc.stack_count = 0;
+	for (int i = 0; i < n; i++) {
+		if (gc.gc_refs[i] > 0) gc_mark(i);
+	}
+	while (gc.stack_count) {
+		gc_each_ref(gc.objects[gc.stack[--gc.stack_count]], gc_mark);
+	}
+
+	int garbage_count = 0;
+	lgcobj* garbage = malloc(sizeof(lgcobj) * (n + 1));
+	for (int i = 0; i < n; i++) {
+		if (!gc.marks[i]) garbage[garbage_count++] = gc.objects[i];
+	}
+
+	/* Pin the garbage so clearing one object cannot free another mid-sweep */
+	for (int i = 0; i < garbage_count; i++) {
+		(*gc_refs_of(garbage[i]))++;
+	}
+	for (int i = 0; i < garbage_count; i++) {
+		gc_clear(garbage[i]);
+	}
+	for (int i = 0; i < garbage_count; i++) {
+		*gc_refs_of(garbage[i]) = 1;
+		switch (garbage[i].kind) {
+		case GC_VAL: lval_del(garbage[i].ptr); break;
+		case GC_ENV: lenv_del(garbage[i].ptr); break;
+		case GC_CELLS: lcells_del(garbage[i].ptr); break;
+		case GC_NODE: lnode_del(garbage[i].ptr); break;
+		}
+	}
+	free(garbage);
+
+	gc.collections++;
+	gc.freed += garbage_count;
+	gc.threshold = gc.count * 2 > 10000 ? gc.count * 2 : 10000;
+
+	gc.pause_last = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	gc.pause_total += gc.pause_last;
+	if (gc.pause_last > gc.pause_max) gc.pause_max = gc.pause_last;
+}
+
+void gc_print_stats(void) {
+	printf("heap objects: %li values, %li environments\n", lval_pool.live, lenv_pool.live);
+	printf("heap size: %li bytes in %li slabs\n", pool_bytes(&lval_pool) + pool_bytes(&lenv_pool),
+		lval_pool.slab_count + lenv_pool.slab_count);
+	printf("slab utilization: %.1f%% values, %.1f%% environments\n", pool_utilization(&lval_pool), pool_utilization(&lenv_pool));
+	printf("allocations: %li values, %li environments\n", lval_pool.allocs, lenv_pool.allocs);
+	printf("tracked objects: %i (next collection at %i)\n", gc.count, gc.threshold);
+	printf("collections: %li, objects freed: %li\n", gc.collections, gc.freed);
+	printf("pause time: %.3f ms last, %.3f ms max, %.3f ms total\n", gc.pause_last, gc.pause_max, gc.pause_total);
+}
+
+void gc_maybe_collect(void) {
+	if (gc.count > gc.threshold) gc_collect();
+}
+
+void gc_cleanup(void) {
+	free(gc.objects);
+	free(gc.gc_refs);
+	free(gc.marks);
+	free(gc.stack);
+}
+
+lenv* lenv_new(void) {
+	lenv* e = pool_alloc(&lenv_pool);
+	e->refs = 1;
+	e->gc_slot = gc_track(e, GC_ENV);
+	e->par = NULL;
+	e->count = 0;
+	e->capacity = 0;
+	e->syms = NULL;
+	e->vals = NULL;
+	e->index_capacity = 0;
+	e->index = NULL;
+	e->layout = NULL;
+	e->captured = 0;
+	e->bound = 0;
+	e->slots = 0;
+	return e;
+}
+
+unsigned long lenv_hash(char* sym) {
+	return ((unsigned long)sym >> 3) * 2654435761u;
+}
+
+/* Rebuilds the open-addressing index so it stays at most half full */
+void lenv_reindex(lenv* e) {
+	int capacity = e->index_capacity ? e->index_capacity : 32;
+	while (capacity < e->count * 2 + 2) capacity *= 2;
+
+	free(e->index);
+	e->index_capacity = capacity;
+	e->index = malloc(sizeof(int) * capacity);
+	for (int i = 0; i < capacity; i++) e->index[i] = -1;
+
+	for (int i = 0; i < e->count; i++) {
+		unsigned long j = lenv_hash(e->syms[i]) & (capacity - 1);
+		while (e->index[j] != -1) j = (j + 1) & (capacity - 1);
+		e->index[j] = i;
+	}
+}
+
+/* Returns the slot holding 'sym' in this frame only, or -1 */
+int lenv_find(lenv* e, char* sym) {
+
+	if (!e->index) {
+		for (int i = 0; i < e->count; i++) {
+			if (e->syms[i] == sym) return i;
+		}
+		return -1;
+	}
+
+	unsigned long j = lenv_hash(sym) & (e->index_capacity - 1);
+	while (e->index[j] != -1) {
+		if (e->syms[e->index[j]] == sym) return e->index[j];
+		j = (j + 1) & (e->index_capacity - 1);
+	}
+	return -1;
+}
+
+lval* lval_alloc(int type) {
+	lval* v = pool_alloc(&lval_pool);
+	v->type = type;
+	v->refs = 1;
+	v->gc_slot = gc_tracks(type) ? gc_track(v, GC_VAL) : -1;
+	v->keyed = 0;
+	return v;
+}
+
+lval* lval_qexpr(void);
+void lenv_put(lenv* e, lval* k, lval* v);
+lval* lval_add(lval* v, lval* x);
+
+int lval_has_sym(lval* list, char* sym) {
+	for (int i = 0; i < list->count; i++) {
+		if (list->cell[i]->sym == sym) return 1;
+	}
+	return 0;
+}
+
+/* Whether 'sym' is bound in 'e' or any frame around it */
+int lenv_binds(lenv* e, char* sym) {
+	for (; e; e = e->par) {
+		if (lenv_find(e, sym) != -1) return 1;
+	}
+	return 0;
+}
+
+/* Adds to 'locals' the symbols not bound from 'e' that 'body' binds with '=',
+ * other than inside a lambda written out in it */
+void lval_put_syms(lval* body, lenv* e, lval* locals) {
+	if (body->type != LVAL_SEXPR && body->type != LVAL_QEXPR) return;
+
+	lval* head = body->count ? body->cell[0] : NULL;
+	if (head && head->type == LVAL_SYM && head->sym == atom_lambda) return;
+
+	if (head && head->type == LVAL_SYM && head->sym == atom_put
+		&& body->count > 1 && body->cell[1]->type == LVAL_QEXPR) {
+		lval* targets = body->cell[1];
+		for (int i = 0; i < targets->count; i++) {
+			lval* t = targets->cell[i];
+			if (t->type != LVAL_SYM || lval_has_sym(locals, t->sym) || lenv_binds(e, t->sym)) continue;
+			lval_add(locals, lval_copy(t));
+		}
+	}
+
+	for (int i = 0; i < body->count; i++) {
+		lval_put_syms(body->cell[i], e, locals);
+	}
+}
+
+/* Free-variable analysis: adds to 'captured' every symbol in 'body' that is
+ * not a formal and is bound by a function frame on the chain from 'e', or not
+ * bound anywhere yet, as a local the frame may still bind with '='. The body
+ * is data, so symbols inside nested Q-expressions count as well, except the
+ * formals of a lambda written out inside it */
+void lval_free_syms(lval* body, lval* formals, lenv* e, lval* captured) {
+	if (body->type == LVAL_SYM) {
+		if (lval_has_sym(formals, body->sym) || lval_has_sym(captured, body->sym)) return;
+
+		lenv* x = e;
+		for (; x->par; x = x->par) {
+			if (lenv_find(x, body->sym) != -1) {
+				lval_add(captured, lval_copy(body));
+				return;
+			}
+		}
+		if (lenv_find(x, body->sym) == -1) lval_add(captured, lval_copy(body));
+		return;
+	}
+
+	if (body->type != LVAL_SEXPR && body->type != LVAL_QEXPR) return;
+
+	if (body->count == 3 && body->cell[0]->type == LVAL_SYM && body->cell[0]->sym == atom_lambda
+		&& body->cell[1]->type == LVAL_QEXPR) {
+		lval* inner = lval_qexpr();
+		for (int i = 0; i < formals->count; i++) lval_add(inner, lval_copy(formals->cell[i]));
+		for (int i = 0; i < body->cell[1]->count; i++) lval_add(inner, lval_copy(body->cell[1]->cell[i]));
+		lval_free_syms(body->cell[2], inner, e, captured);
+		lval_del(inner);
+		return;
+	}
+
+	for (int i = 0; i < body->count; i++) {
+		lval_free_syms(body->cell[i], formals, e, captured);
+	}
+}
+
+/* Returns the box through which a closure made in frame 'e' shares 'k': the
+ * frame's own slot, boxed in place the first time it is captured, or a new
+ * empty slot in 'e' for a symbol that is not bound yet */
+lval* lenv_box(lenv* e, lval* k) {
+	for (lenv* x = e; x->par; x = x->par) {
+		int i = lenv_find(x, k->sym);
+		if (i == -1) continue;
+
+		if (x->vals[i]->type != LVAL_BOX) {
+			lval* b = lval_alloc(LVAL_BOX);
+			b->boxed = x->vals[i];
+			x->vals[i] = b;
+		}
+		return lval_copy(x->vals[i]);
+	}
+
+	lval* b = lval_alloc(LVAL_BOX);
+	b->boxed = NULL;
+	lenv_put(e, k, b);
+	return b;
+}
+
+/* Closures are flat: their free variables are copied into the function's own
+ * frame when it is created, and that frame's parent is the global environment
+ * rather than the chain of frames it was defined in. Each is copied as a box
+ * shared with the defining frame, so an '=' there after the closure was made,
+ * such as binding a local recursive helper, is still seen */
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+	lval* v = lval_alloc(LVAL_FUN);
+
+	v->builtin = NULL;
+	v->fun_name = malloc(strlen("user function") + 1);
+	strcpy(v->fun_name, "user function");
+
+	lenv* global = e;
+	while (global->par) global = global->par;
+
+	v->env = lenv_new();
+	v->env->par = global;
+	global->refs++;
+
+	if (e == global) {
+		v->env->layout = lval_copy(formals);
+	}
+	else {
+		/* What the body binds with '=' itself and is not bound yet stays its own local */
+		lval* locals = lval_qexpr();
+		for (int i = 0; i < formals->count; i++) lval_add(locals, lval_copy(formals->cell[i]));
+		lval_put_syms(body, e, locals);
+
+		lval* layout = lval_qexpr();
+		lval_free_syms(body, locals, e, layout);
+		lval_del(locals);
+
+		for (int i = 0; i < layout->count; i++) {
+			lval* x = lenv_box(e, layout->cell[i]);
+			lenv_put(v->env, layout->cell[i], x);
+			lval_del(x);
+		}
+		v->env->captured = layout->count;
+		for (int i = 0; i < formals->count; i++) {
+			lval_add(layout, lval_copy(formals->cell[i]));
+		}
+		v->env->layout = layout;
+	}
+
+	v->formals = formals;
+	v->body = body;
+	return v;
+}
+
+/* Booleans and small integers are shared constants rather than allocated */
+#define LVAL_SMALL_MIN -128
+#define LVAL_SMALL_MAX 1023
+
+lval lval_true = { .type = LVAL_BOOL, .refs = LVAL_IMMORTAL, .gc_slot = -1, .bool = 1 };
+lval lval_false = { .type = LVAL_BOOL, .refs = LVAL_IMMORTAL, .gc_slot = -1, .bool = 0 };
+lval lval_small_nums[LVAL_SMALL_MAX - LVAL_SMALL_MIN + 1];
+
+void lval_small_nums_init(void) {
+	for (int i = LVAL_SMALL_MIN; i <= LVAL_SMALL_MAX; i++) {
+		lval* v = &lval_small_nums[i - LVAL_SMALL_MIN];
+		v->type = LVAL_INT;
+		v->refs = LVAL_IMMORTAL;
+		v->gc_slot = -1;
+		v->integer = i;
+	}
+}
+
+lval* lval_int(long long x) {
+	if (x >= LVAL_SMALL_MIN && x <= LVAL_SMALL_MAX) {
+		return &lval_small_nums[x - LVAL_SMALL_MIN];
+	}
+
+	lval* v = lval_alloc(LVAL_INT);
+	v->integer = x;
+	return v;
+}
+
+/* Takes ownership of 'b', storing it as an LVAL_INT whenever it fits */
+lval* lval_big(lbig b) {
+	long long x;
+	if (lbig_to_int(&b, &x)) {
+		lbig_free(&b);
+		return lval_int(x);
+	}
+
+	lval* v = lval_alloc(LVAL_BIG);
+	v->big = b;
+	return v;
+}
+
+lval* lval_num(double x) {
+	lval* v = lval_alloc(LVAL_NUM);
+	v->num = x;
+	return v;
+}
+
+/* Elements are left uninitialized for the caller to fill */
+lval* lval_arr(int kind, int count) {
+	lval* v = lval_alloc(LVAL_ARR);
+	v->arr.kind = kind;
+	v->arr.count = count;
+	v->arr.rows = -1;
+	v->arr.cols = 0;
+	v->arr.i64 = malloc(sizeof(long long) * (count ? count : 1));
+	return v;
+}
+
+lval* lval_bool(int x) {
+	return x ? &lval_true : &lval_false;
+}
+
+lval* lval_err(char* fmt, ...) {
+	lval* v = lval_alloc(LVAL_ERR);
+
+	va_list va;
+	va_start(va, fmt);
+
+	char buf[512];
+	int len = vsnprintf(buf, sizeof(buf), fmt, va);
+	if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+
+	v->err = malloc(len + 1);
+	memcpy(v->err, buf, len + 1);
+
+	va_end(va);
+
+	return v;
+}
+
+lval* lval_sym(char* s) {
+	lval* v = lval_alloc(LVAL_SYM);
+	v->sym = atom_intern(s);
+	return v;
+}
+
+/* A string of 'len' characters for the caller to fill in, NUL included */
+lval* lval_str_alloc(long len) {
+	lval* v = lval_alloc(LVAL_STR);
+	if (len < LSTR_SMALL) {
+		v->str = v->small;
+	} else {
+		v->str = malloc(len + 1);
+		v->left = NULL;
+	}
+	v->len = len;
+	v->str_hash = 0;
+	return v;
+}
+
+/* Takes ownership of 's', which holds 'len' characters and a NUL */
+lval* lval_str_take(char* s, long len) {
+	if (len < LSTR_SMALL) {
+		lval* v = lval_str_alloc(len);
+		memcpy(v->str, s, len + 1);
+		free(s);
+		return v;
+	}
+
+	lval* v = lval_alloc(LVAL_STR);
+	v->str = s;
+	v->len = len;
+	v->left = NULL;
+	v->str_hash = 0;
+	return v;
+}
+
+lval* lval_str(char* s) {
+	long len = strlen(s);
+	lval* v = lval_str_alloc(len);
+	memcpy(v->str, s, len + 1);
+	return v;
+}
+
+/* Concatenations shorter than this are copied rather than made into a rope */
+#define LSTR_ROPE_MIN 64
+
+/* Releases the pieces of a rope without recursing, since appending in a
+ * loop builds ropes as deep as they are long */
+void lrope_release(lval* v) {
+	int count = 0;
+	int capacity = 16;
+	lval** stack = malloc(sizeof(lval*) * capacity);
+	stack[count++] = v->left;
+	stack[count++] = v->right;
+	v->left = NULL;
+	v->right = NULL;
+
+	while (count) {
+		lval* x = stack[--count];
+		if (!x->str && x->left && x->refs == 1) {
+			if (count + 2 > capacity) {
+				capacity *= 2;
+				stack = realloc(stack, sizeof(lval*) * capacity);
+			}
+			stack[count++] = x->left;
+			stack[count++] = x->right;
+			x->left = NULL;
+			x->right = NULL;
+		}
+		lval_del(x);
+	}
+	free(stack);
+}
+
+int lstr_is_view(lval* v) {
+	return v->str && v->str != v->small && v->left;
+}
+
+char* lval_str_flat(lval* v);
+
+/* The 'len' characters of 'v', not necessarily followed by a NUL */
+char* lstr_chars(lval* v) {
+	return v->str ? v->str : lval_str_flat(v);
+}
+
+/* The characters of 'v' as a C string, copying a rope's pieces or a view's
+ * characters into a buffer of its own the first time */
+char* lval_str_flat(lval* v) {
+	if (lstr_is_view(v)) {
+		char* s = malloc(v->len + 1);
+		memcpy(s, v->str, v->len);
+		s[v->len] = '\0';
+		lval_del(v->left);
+		v->left = NULL;
+		v->str = s;
+	}
+	if (v->str) return v->str;
+
+	char* s = malloc(v->len + 1);
+	long pos = 0;
+
+	int count = 0;
+	int capacity = 16;
+	lval** stack = malloc(sizeof(lval*) * capacity);
+	stack[count++] = v;
+	while (count) {
+		lval* x = stack[--count];
+		if (x->str) {
+			memcpy(s + pos, x->str, x->len);
+			pos += x->len;
+			continue;
+		}
+		if (count + 2 > capacity) {
+			capacity *= 2;
+			stack = realloc(stack, sizeof(lval*) * capacity);
+		}
+		stack[count++] = x->right;
+		stack[count++] = x->left;
+	}
+	free(stack);
+	s[pos] = '\0';
+
+	lrope_release(v);
+	v->str = s;
+	return s;
+}
+
+/* 'x' followed by 'y', consuming both */
+lval* lval_str_concat(lval* x, lval* y) {
+	if (y->len == 0) {
+		lval_del(y);
+		return x;
+	}
+	if (x->len == 0) {
+		lval_del(x);
+		return y;
+	}
+
+	long len = x->len + y->len;
+	if (len < LSTR_ROPE_MIN) {
+		lval* v = lval_str_alloc(len);
+		memcpy(v->str, lstr_chars(x), x->len);
+		memcpy(v->str + x->len, lstr_chars(y), y->len);
+		v->str[len] = '\0';
+		lval_del(x);
+		lval_del(y);
+		return v;
+	}
+
+	lval* v = lval_alloc(LVAL_STR);
+	v->str = NULL;
+	v->len = len;
+	v->left = x;
+	v->right = y;
+	v->str_hash = 0;
+	return v;
+}
+
+/* Hashes the characters and remembers it, so a string is only hashed once */
+unsigned long lstr_hash(lval* v) {
+	if (v->str_hash) return v->str_hash;
+
+	char* s = lstr_chars(v);
+	unsigned long h = 2166136261u;
+	for (long i = 0; i < v->len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	v->str_hash = h ? h : 1;
+	return v->str_hash;
+}
+
+/* Lengths and any hashes already known settle most unequal pairs before the characters are compared */
+int lstr_eq(lval* x, lval* y) {
+	if (x->len != y->len) return 0;
+	if (x->str_hash && y->str_hash && x->str_hash != y->str_hash) return 0;
+	return memcmp(lstr_chars(x), lstr_chars(y), x->len) == 0;
+}
+
+/* Characters [start, start + len) of 'v'. Long ones share the buffer they are in */
+lval* lval_substr(lval* v, long start, long len) {
+	char* s = lstr_chars(v);
+
+	if (len < LSTR_SMALL) {
+		lval* x = lval_str_alloc(len);
+		memcpy(x->str, s + start, len);
+		x->str[len] = '\0';
+		return x;
+	}
+	if (len == v->len) return lval_copy(v);
+
+	lval* x = lval_alloc(LVAL_STR);
+	x->str = s + start;
+	x->len = len;
+	x->left = lval_copy(lstr_is_view(v) ? v->left : v);
+	x->right = NULL;
+	x->str_hash = 0;
+	return x;
+}
+
+lval* lval_fun(lbuiltin func, char* func_name) {
+	lval* v = lval_alloc(LVAL_FUN);
+	v->builtin = func;
+	v->fun_name = malloc(strlen(func_name) + 1);
+	strcpy(v->fun_name, func_name);
+	v->env = NULL;
+	v->formals = NULL;
+	v->body = NULL;
+	return v;
+}
+
+/* A record of type 'rtype' with its fields not yet filled in */
+lval* lval_rec(lval* rtype) {
+	lval* v = lval_alloc(LVAL_REC);
+	v->rtype = lval_copy(rtype);
+	v->fields = malloc(sizeof(lval*) * rtype->count);
+	return v;
+}
+
+lval* lval_sexpr(void) {
+	lval* v = lval_alloc(LVAL_SEXPR);
+	v->count = 0;
+	v->cell = NULL;
+	v->code = NULL;
+	v->cells = NULL;
+	return v;
+}
+
+lval* lval_qexpr(void) {
+	lval* v = lval_alloc(LVAL_QEXPR);
+	v->count = 0;
+	v->cell = NULL;
+	v->code = NULL;
+	v->cells = NULL;
+	return v;
+}
+
+void lval_del(lval* v) {
+
+	if (v->refs == LVAL_IMMORTAL || --v->refs > 0) return;
+
+	if (v->gc_slot != -1) gc_untrack(v->gc_slot);
+
+	switch (v->type) {
+	case LVAL_NUM:
+	case LVAL_INT:
+	case LVAL_BOOL:
+		break;
+
+	case LVAL_BIG:
+		free(v->big.limbs);
+		break;
+	case LVAL_ARR:
+		free(v->arr.i64);
+		break;
+	case LVAL_MAP:
+	case LVAL_SET:
+		lhash_del(v->hash);
+		break;
+	case LVAL_PVEC:
+	case LVAL_PMAP:
+		if (v->trie.root) lnode_del(v->trie.root);
+		if (v->trie.tail) lnode_del(v->trie.tail);
+		break;
+
+	case LVAL_ERR:
+		free(v->err);
+		break;
+	case LVAL_SYM:
+		break;
+	case LVAL_STR:
+		/* A rope whose pieces lrope_release already took has NULL for both */
+		if (!v->str && v->left) lrope_release(v);
+		else if (lstr_is_view(v)) lval_del(v->left);
+		else if (v->str && v->str != v->small) free(v->str);
+		break;
+
+	case LVAL_FUN:
+		if (!v->builtin) {
+			lenv_del(v->env);
+			lval_del(v->formals);
+			lval_del(v->body);
+		}
+		else if (v->body) lval_del(v->body);
+		free(v->fun_name);
+		break;
+	case LVAL_REC:
+		for (int i = 1; i < v->rtype->count; i++) {
+			lval_del(v->fields[i - 1]);
+		}
+		free(v->fields);
+		lval_del(v->rtype);
+		break;
+	case LVAL_BOX:
+		if (v->boxed) lval_del(v->boxed);
+		break;
+
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+	case LVAL_VEC: {
+		if (v->cells) lcells_del(v->cells);
+		if (v->code) lcode_del(v->code);
+		break;
+	}
+	}
+
+	pool_free(&lval_pool, v);
+}
+
+lcells* lcells_new(int size) {
+	lcells* b = malloc(sizeof(lcells) + sizeof(lval*) * size);
+	b->refs = 1;
+	b->gc_slot = gc_track(b, GC_CELLS);
+	b->lo = 0;
+	b->hi = 0;
+	b->size = size;
+	return b;
+}
+
+void lcells_del(lcells* b) {
+
+	if (--b->refs > 0) return;
+
+	gc_untrack(b->gc_slot);
+
+	for (int i = b->lo; i < b->hi; i++) {
+		lval_del(b->slots[i]);
+	}
+	free(b);
+}
+
+void lenv_del(lenv* e) {
+
+	/* Walk up the parent chain iteratively, it can be as long as a tail loop */
+	while (e && --e->refs == 0) {
+		lenv* par = e->par;
+
+		gc_untrack(e->gc_slot);
+
+		if (e->layout) lval_del(e->layout);
+		for (int i = 0; i < e->count; i++) {
+			lval_del(e->vals[i]);
+		}
+		free(e->syms);
+		free(e->vals);
+		free(e->index);
+		pool_free(&lenv_pool, e);
+
+		e = par;
+	}
+}
+
+lenv* lenv_copy(lenv* e) {
+	lenv* n = pool_alloc(&lenv_pool);
+	n->refs = 1;
+	n->gc_slot = gc_track(n, GC_ENV);
+	n->par = e->par;
+	if (n->par) n->par->refs++;
+	n->count = e->count;
+	n->capacity = e->count;
+	n->syms = malloc(sizeof(char*) * n->count);
+	n->vals = malloc(sizeof(lval*) * n->count);
+	for (int i = 0; i < e->count; i++) {
+		n->syms[i] = e->syms[i];
+		n->vals[i] = lval_copy(e->vals[i]);
+	}
+
+	n->index_capacity = e->index_capacity;
+	n->index = NULL;
+	if (e->index) {
+		n->index = malloc(sizeof(int) * e->index_capacity);
+		memcpy(n->index, e->index, sizeof(int) * e->index_capacity);
+	}
+
+	n->layout = e->layout ? lval_copy(e->layout) : NULL;
+	n->captured = e->captured;
+	n->bound = e->bound;
+	n->slots = e->slots;
+	return n;
+}
+
+/* Binds 'k' in frame 'e'. A variable the frame shares with its closures is
+ * updated in its box, while a captured one is shadowed like any other */
+void lenv_put(lenv* e, lval* k, lval* v) {
+
+	int i = lenv_find(e, k->sym);
+	if (i != -1) {
+		lval* x = e->vals[i];
+		if (x->type == LVAL_BOX && i >= e->captured) {
+			if (x->boxed) lval_del(x->boxed);
+			x->boxed = lval_copy(v);
+			return;
+		}
+		lval_del(x);
+		e->vals[i] = lval_copy(v);
+		return;
+	}
+
+	if (e->count == e->capacity) {
+		e->capacity = e->capacity ? e->capacity * 2 : 4;
+		e->vals = realloc(e->vals, sizeof(lval*) * e->capacity);
+		e->syms = realloc(e->syms, sizeof(char*) * e->capacity);
+	}
+
+	e->count++;
+	e->vals[e->count - 1] = lval_copy(v);
+	e->syms[e->count - 1] = k->sym;
+
+	if (e->index && e->count * 2 <= e->index_capacity) {
+		unsigned long j = lenv_hash(k->sym) & (e->index_capacity - 1);
+		while (e->index[j] != -1) j = (j + 1) & (e->index_capacity - 1);
+		e->index[j] = e->count - 1;
+	}
+	else if (e->count > LENV_INLINE_MAX) {
+		lenv_reindex(e);
+	}
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+	while (e->par) e = e->par;
+
+	lenv_put(e, k, v);
+}
+
+/* The value in slot 'i' of 'e', looking through a box, or NULL for a box
+ * whose symbol is not bound yet */
+lval* lenv_slot(lenv* e, int i) {
+	lval* x = e->vals[i];
+	return x->type == LVAL_BOX ? x->boxed : x;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+
+	while (e) {
+		int i = lenv_find(e, k->sym);
+		if (i != -1 && lenv_slot(e, i)) return lval_copy(lenv_slot(e, i));
+		e = e->par;
+	}
+
+	return lval_err("Unbound symbol '%s'", k->sym);
+}
+
+/* Drops compiled code once the list it was compiled from changes */
+void lval_invalidate(lval* v) {
+	if (v->code) {
+		lcode_del(v->code);
+		v->code = NULL;
+	}
+}
+
+/* Gives 'v' a buffer of its own holding exactly its cells, with at least
+ * 'before' free slots in front of them and 'after' behind. Growth doubles the
+ * room at that end, so pushing onto either end is amortized O(1) */
+void lval_own_cells(lval* v, int before, int after) {
+	lcells* b = v->cells;
+	int off = b ? v->cell - b->slots : 0;
+	int front = 0;
+	int back = 0;
+
+	if (b && b->refs == 1) {
+		/* Nothing else sees the cells slices have dropped, so release them */
+		for (int i = b->lo; i < off; i++) lval_del(b->slots[i]);
+		for (int i = off + v->count; i < b->hi; i++) lval_del(b->slots[i]);
+		b->lo = off;
+		b->hi = off + v->count;
+		if (off >= before && b->size - b->hi >= after) return;
+
+		front = off;
+		back = b->size - b->hi;
+	}
+
+	int grow = v->count > 4 ? v->count : 4;
+	if (front < before) front = before > grow ? before : grow;
+	if (back < after) back = after > grow ? after : grow;
+
+	lcells* n = lcells_new(front + v->count + back);
+	n->lo = front;
+	n->hi = front + v->count;
+
+	if (b && b->refs == 1) {
+		memcpy(&n->slots[front], v->cell, sizeof(lval*) * v->count);
+		b->hi = b->lo;
+	}
+	else {
+		for (int i = 0; i < v->count; i++) {
+			n->slots[front + i] = lval_copy(v->cell[i]);
+		}
+	}
+
+	if (b) lcells_del(b);
+	v->cells = n;
+	v->cell = &n->slots[front];
+}
+
+/* Appending right after the last claimed slot needs no copy, even when the
+ * buffer is shared, since no other list can see that slot */
+lval* lval_add(lval* v, lval* x) {
+	lval_invalidate(v);
+
+	lcells* b = v->cells;
+	if (!b || v->cell + v->count != &b->slots[b->hi] || b->hi == b->size) {
+		lval_own_cells(v, 0, 1);
+		b = v->cells;
+	}
+
+	b->slots[b->hi++] = x;
+	v->count++;
+	return v;
+}
+
+/* Adds 'x' in front of the first cell, claiming the slot before it in the same way */
+lval* lval_push(lval* v, lval* x) {
+	lval_invalidate(v);
+
+	lcells* b = v->cells;
+	if (!b || v->cell != &b->slots[b->lo] || b->lo == 0) {
+		lval_own_cells(v, 1, 0);
+		b = v->cells;
+	}
+
+	b->lo--;
+	v->cell--;
+	v->count++;
+	v->cell[0] = x;
+	return v;
+}
+
+/* Removing either end only moves the window over the cells */
+lval* lval_pop(lval* v, int i) {
+	lval_invalidate(v);
+
+	if (i != 0 && i != v->count - 1) {
+		lval_own_cells(v, 0, 0);
+		lval* x = v->cell[i];
+		memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+		v->cells->hi--;
+		v->count--;
+		return x;
+	}
+
+	/* The buffer's reference goes with the cell unless other lists may still see it */
+	lcells* b = v->cells;
+	lval* x = v->cell[i];
+	if (b->refs == 1 && &v->cell[i] == &b->slots[b->lo]) b->lo++;
+	else if (b->refs == 1 && &v->cell[i] == &b->slots[b->hi - 1]) b->hi--;
+	else lval_copy(x);
+
+	if (i == 0) v->cell++;
+	v->count--;
+	return x;
+}
+
+lval* lval_take(lval* v, int i) {
+	lval* x = lval_pop(v, i);
+	lval_del(v);
+	return x;
+}
+
+lval* lval_join(lval* x, lval* y) {
+	lval_invalidate(x);
+
+	if (y->count == 0) {
+		lval_del(y);
+		return x;
+	}
+
+	lcells* b = x->cells;
+	if (!b || x->cell + x->count != &b->slots[b->hi] || b->size - b->hi < y->count) {
+		lval_own_cells(x, 0, y->count);
+		b = x->cells;
+	}
+
+	/* An unshared 'y' that is the only view of its buffer hands over its cells */
+	lcells* c = y->cells;
+	if (y->refs == 1 && c->refs == 1 && y->cell == &c->slots[c->lo] && y->count == c->hi - c->lo) {
+		memcpy(&b->slots[b->hi], y->cell, sizeof(lval*) * y->count);
+		c->hi = c->lo;
+	}
+	else {
+		for (int i = 0; i < y->count; i++) {
+			b->slots[b->hi + i] = lval_copy(y->cell[i]);
+		}
+	}
+
+	b->hi += y->count;
+	x->count += y->count;
+	lval_del(y);
+	return x;
+}
+
+/* Values are immutable once shared, so copying only takes another reference */
+lval* lval_copy(lval* v) {
+	if (v->refs != LVAL_IMMORTAL) v->refs++;
+	return v;
+}
+
+/* One level copy, children are shared rather than duplicated */
+lval* lval_clone(lval* v) {
+
+	lval* x = lval_alloc(v->type);
+
+	switch (v->type) {
+
+	case LVAL_FUN:
+		x->builtin = v->builtin;
+		x->fun_name = malloc(strlen(v->fun_name) + 1);
+		strcpy(x->fun_name, v->fun_name);
+		if (!v->builtin) {
+			x->env = lenv_copy(v->env);
+			x->formals = lval_copy(v->formals);
+			x->body = lval_copy(v->body);
+		}
+		else x->body = v->body ? lval_copy(v->body) : NULL;
+		break;
+	case LVAL_REC:
+		x->rtype = lval_copy(v->rtype);
+		x->fields = malloc(sizeof(lval*) * v->rtype->count);
+		for (int i = 1; i < v->rtype->count; i++) {
+			x->fields[i - 1] = lval_copy(v->fields[i - 1]);
+		}
+		break;
+	case LVAL_NUM:
+		x->num = v->num;
+		break;
+	case LVAL_INT:
+		x->integer = v->integer;
+		break;
+	case LVAL_BIG:
+		x->big = lbig_copy(&v->big);
+		break;
+	case LVAL_ARR:
+		x->arr = v->arr;
+		x->arr.i64 = malloc(sizeof(long long) * (v->arr.count ? v->arr.count : 1));
+		memcpy(x->arr.i64, v->arr.i64, sizeof(long long) * v->arr.count);
+		break;
+	case LVAL_MAP:
+	case LVAL_SET:
+		x->hash = lhash_copy(v->hash);
+		break;
+	case LVAL_PVEC:
+	case LVAL_PMAP:
+		x->trie = v->trie;
+		if (x->trie.root) x->trie.root->refs++;
+		if (x->trie.tail) x->trie.tail->refs++;
+		break;
+	case LVAL_BOOL:
+		x->bool = v->bool;
+		break;
+
+	case LVAL_ERR:
+		x->err = malloc(strlen(v->err) + 1);
+		strcpy(x->err, v->err);
+		break;
+
+	case LVAL_SYM:
+		x->sym = v->sym;
+		break;
+
+	case LVAL_STR:
+		x->len = v->len;
+		x->str_hash = v->str_hash;
+		if (v->len < LSTR_SMALL) {
+			x->str = x->small;
+		} else {
+			x->str = malloc(v->len + 1);
+			x->left = NULL;
+		}
+		memcpy(x->str, lstr_chars(v), v->len);
+		x->str[v->len] = '\0';
+		break;
+
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+	case LVAL_VEC: {
+		/* Lists share their cells, which are only copied once either one changes them */
+		x->count = v->count;
+		x->cell = v->cell;
+		x->code = NULL;
+		x->cells = v->cells;
+		if (x->cells) x->cells->refs++;
+		break;
+	}
+	}
+
+	return x;
+}
+
+/* Copy-on-write: returns 'v' itself when unshared, otherwise a private clone */
+lval* lval_mut(lval* v) {
+	if (v->refs == 1) return v;
+
+	lval* x = lval_clone(v);
+	if (v->refs != LVAL_IMMORTAL) v->refs--;
+	return x;
+}
+
+/* 'v' to be changed where every holder sees it, or a copy if that would leave
+ * a hash key's stored hash stale */
+lval* lval_mut_in_place(lval* v) {
+	if (!v->keyed) return v;
+
+	lval* x = lval_clone(v);
+	lval_del(v);
+	return x;
+}
+
+/* Narrows 'v' to 'count' cells from 'start' in O(1), a shared list gets a
+ * new view of the same buffer instead of a copy */
+lval* lval_slice(lval* v, int start, int count) {
+	v = lval_mut(v);
+	lval_invalidate(v);
+
+	lcells* b = v->cells;
+	if (b && b->refs == 1) {
+		int off = v->cell - b->slots;
+		int at_lo = off == b->lo;
+		int at_hi = off + v->count == b->hi;
+
+		/* Release the dropped cells right away when nothing else sees them */
+		if (at_lo) {
+			for (int i = 0; i < start; i++) lval_del(v->cell[i]);
+			b->lo = off + start;
+		}
+		if (at_hi) {
+			for (int i = start + count; i < v->count; i++) lval_del(v->cell[i]);
+			b->hi = off + start + count;
+		}
+	}
+
+	v->cell += start;
+	v->count = count;
+	return v;
+}
+
+/* Hash Tables */
+
+int lval_eq(lval* x, lval* y);
+lval* ltrie_items(lval* v);
+void lnode_key_each(lnode* n, void (*f)(lval*));
+
+unsigned long lhash_mix(unsigned long h) {
+	h ^= h >> 15;
+	h *= 2654435761u;
+	h ^= h >> 13;
+	return h;
+}
+
+unsigned long lhash_double(double d) {
+	if (d == 0) d = 0;
+	unsigned long long bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return lhash_mix((unsigned long)(bits ^ (bits >> 32)));
+}
+
+unsigned long lval_hash(lval* v) {
+	unsigned long h = lhash_mix(v->type + 1);
+
+	switch (v->type) {
+	case LVAL_NUM:
+	case LVAL_INT:
+	case LVAL_BIG:
+		return lhash_double(lval_to_double(v));
+	case LVAL_BOOL:
+		return h + v->bool;
+	case LVAL_ERR:
+		return h ^ atom_hash(v->err);
+	case LVAL_STR:
+		return h ^ lstr_hash(v);
+	case LVAL_SYM:
+		return h ^ lenv_hash(v->sym);
+
+	case LVAL_FUN:
+		if (v->builtin) return h ^ lhash_mix((unsigned long)(size_t)v->builtin) ^ lhash_mix((unsigned long)(size_t)v->body);
+		h = h * 31 + v->env->bound;
+		h = h * 31 + lval_hash(v->formals);
+		return h * 31 + lval_hash(v->body);
+
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+	case LVAL_VEC:
+		for (int i = 0; i < v->count; i++) h = h * 31 + lval_hash(v->cell[i]);
+		return lhash_mix(h);
+
+	case LVAL_REC:
+		h = h * 31 + lhash_mix((unsigned long)(size_t)v->rtype);
+		for (int i = 1; i < v->rtype->count; i++) h = h * 31 + lval_hash(v->fields[i - 1]);
+		return lhash_mix(h);
+
+	case LVAL_ARR:
+		h = (h * 31 + v->arr.rows) * 31 + v->arr.cols;
+		for (int i = 0; i < v->arr.count; i++) {
+			h = h * 31 + (v->arr.kind == LARR_I64 ? lhash_mix((unsigned long)v->arr.i64[i]) : lhash_double(v->arr.f64[i]));
+		}
+		return lhash_mix(h);
+
+	case LVAL_MAP:
+	case LVAL_SET: {
+		unsigned long sum = 0;
+		for (int i = 0; i < v->hash->used; i++) {
+			if (!v->hash->keys[i]) continue;
+			unsigned long e = v->hash->hashes[i];
+			if (v->hash->is_map) e = lhash_mix(e * 31 + lval_hash(v->hash->vals[i]));
+			sum += e;
+		}
+		return h ^ lhash_mix(sum);
+	}
+
+	case LVAL_PVEC:
+	case LVAL_PMAP: {
+		lval* items = ltrie_items(v);
+		unsigned long sum = 0;
+		for (int i = 0; i < items->count; i++) {
+			if (v->type == LVAL_PVEC) h = h * 31 + lval_hash(items->cell[i]);
+			else sum += lhash_mix(lval_hash(items->cell[i]->cell[0]) * 31 + lval_hash(items->cell[i]->cell[1]));
+		}
+		lval_del(items);
+		return v->type == LVAL_PVEC ? lhash_mix(h) : h ^ lhash_mix(sum);
+	}
+	}
+
+	return h;
+}
+
+/* Whether 'v' can hold values that are part of its hash */
+int lval_key_part(lval* v) {
+	switch (v->type) {
+	case LVAL_VEC: case LVAL_SEXPR: case LVAL_QEXPR: case LVAL_REC:
+	case LVAL_MAP: case LVAL_SET: case LVAL_PVEC: case LVAL_PMAP:
+		return 1;
+	}
+	return 0;
+}
+
+/* Applies 'f' to the values inside 'v' that its hash is made of. A table's
+ * own keys are left out, they are counted as keys of that table already */
+void lval_key_each(lval* v, void (*f)(lval*)) {
+	switch (v->type) {
+	case LVAL_VEC:
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		for (int i = 0; i < v->count; i++) f(v->cell[i]);
+		break;
+	case LVAL_REC:
+		for (int i = 1; i < v->rtype->count; i++) f(v->fields[i - 1]);
+		break;
+	case LVAL_MAP:
+		for (int i = 0; i < v->hash->used; i++) {
+			if (v->hash->keys[i]) f(v->hash->vals[i]);
+		}
+		break;
+	case LVAL_PVEC:
+	case LVAL_PMAP:
+		lnode_key_each(v->trie.root, f);
+		lnode_key_each(v->trie.tail, f);
+		break;
+	}
+}
+
+/* Counts 'v' as part of one more hash key. While counted, the vectors and
+ * tables a key is made of are copied rather than changed in place, see
+ * lval_mut_in_place. A value counted already accounts for everything inside
+ * it, so only the first count walks into it and only the last uncount does */
+void lval_key_ref(lval* v) {
+	if (!lval_key_part(v) || v->keyed++) return;
+	lval_key_each(v, lval_key_ref);
+}
+
+void lval_key_unref(lval* v) {
+	if (!lval_key_part(v) || --v->keyed) return;
+	lval_key_each(v, lval_key_unref);
+}
+
+lhash* lhash_new(int is_map) {
+	lhash* h = calloc(1, sizeof(lhash));
+	h->is_map = is_map;
+	return h;
+}
+
+/* Compacts the holes out of the entries and rebuilds the index for them */
+void lhash_reindex(lhash* h) {
+	int n = 0;
+	for (int i = 0; i < h->used; i++) {
+		if (!h->keys[i]) continue;
+		h->keys[n] = h->keys[i];
+		if (h->is_map) h->vals[n] = h->vals[i];
+		h->hashes[n] = h->hashes[i];
+		n++;
+	}
+	h->used = n;
+
+	int capacity = h->index_capacity ? h->index_capacity : 16;
+	while (capacity < h->count * 2 + 2) capacity *= 2;
+
+	free(h->index);
+	h->index_capacity = capacity;
+	h->index = malloc(sizeof(int) * capacity);
+	for (int i = 0; i < capacity; i++) h->index[i] = -1;
+
+	for (int i = 0; i < h->used; i++) {
+		unsigned long j = h->hashes[i] & (capacity - 1);
+		while (h->index[j] != -1) j = (j + 1) & (capacity - 1);
+		h->index[j] = i;
+	}
+}
+
+/* Returns the entry holding a key equal to 'k' with hash 'hk', or -1 */
+int lhash_find(lhash* h, lval* k, unsigned long hk) {
+	if (!h->index) return -1;
+
+	unsigned long j = hk & (h->index_capacity - 1);
+	while (h->index[j] != -1) {
+		int i = h->index[j];
+		if (h->keys[i] && h->hashes[i] == hk && lval_eq(h->keys[i], k)) return i;
+		j = (j + 1) & (h->index_capacity - 1);
+	}
+	return -1;
+}
+
+/* Consumes 'k' and 'v', replacing the value of an equal key already there */
+void lhash_put(lhash* h, lval* k, lval* v) {
+	unsigned long hk = lval_hash(k);
+	int i = lhash_find(h, k, hk);
+
+	if (i != -1) {
+		lval_del(k);
+		if (h->is_map) {
+			lval_del(h->vals[i]);
+			h->vals[i] = v;
+		}
+		return;
+	}
+
+	if (h->used == h->capacity && h->count < h->used) lhash_reindex(h);
+	if (h->used == h->capacity) {
+		h->capacity = h->capacity ? h->capacity * 2 : 8;
+		h->keys = realloc(h->keys, sizeof(lval*) * h->capacity);
+		if (h->is_map) h->vals = realloc(h->vals, sizeof(lval*) * h->capacity);
+		h->hashes = realloc(h->hashes, sizeof(unsigned long) * h->capacity);
+	}
+
+	i = h->used++;
+	h->count++;
+	lval_key_ref(k);
+	h->keys[i] = k;
+	if (h->is_map) h->vals[i] = v;
+	h->hashes[i] = hk;
+
+	if (h->used * 2 > h->index_capacity) {
+		lhash_reindex(h);
+		return;
+	}
+
+	unsigned long j = hk & (h->index_capacity - 1);
+	while (h->index[j] != -1) j = (j + 1) & (h->index_capacity - 1);
+	h->index[j] = i;
+}
+
+/* Leaves a hole where the key was, its index slot keeps probing chains intact */
+int lhash_remove(lhash* h, lval* k) {
+	int i = lhash_find(h, k, lval_hash(k));
+	if (i == -1) return 0;
+
+	lval_key_unref(h->keys[i]);
+	lval_del(h->keys[i]);
+	if (h->is_map) lval_del(h->vals[i]);
+	h->keys[i] = NULL;
+	h->count--;
+	return 1;
+}
+
+lhash* lhash_copy(lhash* h) {
+	lhash* n = lhash_new(h->is_map);
+	n->capacity = h->count;
+	n->keys = malloc(sizeof(lval*) * n->capacity);
+	if (n->is_map) n->vals = malloc(sizeof(lval*) * n->capacity);
+	n->hashes = malloc(sizeof(unsigned long) * n->capacity);
+
+	for (int i = 0; i < h->used; i++) {
+		if (!h->keys[i]) continue;
+		n->keys[n->used] = lval_copy(h->keys[i]);
+		lval_key_ref(n->keys[n->used]);
+		if (n->is_map) n->vals[n->used] = lval_copy(h->vals[i]);
+		n->hashes[n->used] = h->hashes[i];
+		n->used++;
+	}
+	n->count = n->used;
+
+	if (n->count) lhash_reindex(n);
+	return n;
+}
+
+/* Drops every entry, leaving an empty table */
+void lhash_clear(lhash* h) {
+	for (int i = 0; i < h->used; i++) {
+		if (!h->keys[i]) continue;
+		lval_del(h->keys[i]);
+		if (h->is_map) lval_del(h->vals[i]);
+	}
+	h->count = 0;
+	h->used = 0;
+	free(h->index);
+	h->index = NULL;
+	h->index_capacity = 0;
+}
+
+/* The collector clears tables with lhash_clear alone, as the keys may be
+ * garbage too. Whatever they are part of then simply stays counted */
+void lhash_del(lhash* h) {
+	for (int i = 0; i < h->used; i++) {
+		if (h->keys[i]) lval_key_unref(h->keys[i]);
+	}
+	lhash_clear(h);
+	free(h->keys);
+	free(h->vals);
+	free(h->hashes);
+	free(h);
+}
+
+int lhash_eq(lhash* x, lhash* y) {
+	if (x->count != y->count) return 0;
+	for (int i = 0; i < x->used; i++) {
+		if (!x->keys[i]) continue;
+		int j = lhash_find(y, x->keys[i], x->hashes[i]);
+		if (j == -1) return 0;
+		if (x->is_map && !lval_eq(x->vals[i], y->vals[j])) return 0;
+	}
+	return 1;
+}
+
+lval* lval_hash_new(int type) {
+	lval* v = lval_alloc(type);
+	v->hash = lhash_new(type == LVAL_MAP);
+	return v;
+}
+
+/* Persistent Collections */
+
+/*
+ * Every update returns a new version and leaves the old one intact. Only the
+ * nodes on the path from the root to the changed slot are copied, O(log32 n)
+ * of them, and the new version shares every other node with the old one.
+ */
+
+lnode* lnode_new(int kind, int count) {
+	int slots = kind >= LNODE_MAP ? count * 2 : count;
+	lnode* n = malloc(sizeof(lnode) + sizeof(void*) * slots);
+	n->refs = 1;
+	n->gc_slot = gc_track(n, GC_NODE);
+	n->kind = kind;
+	n->count = count;
+	n->bitmap = 0;
+	n->hash = 0;
+	return n;
+}
+
+/* Whether slot 'i' holds a child node rather than a value */
+int lnode_is_child(lnode* n, int i) {
+	if (n->kind == LNODE_BRANCH) return 1;
+	return n->kind == LNODE_MAP && (i & 1) && n->slots[i - 1] == NULL;
+}
+
+/* Whether slot 'i' holds a map key */
+int lnode_is_key(lnode* n, int i) {
+	return n->kind >= LNODE_MAP && !(i & 1) && n->slots[i];
+}
+
+/* Slot 'i' with a new reference taken for the node or value in it, a key
+ * is also counted once more as a key */
+void* lnode_share(lnode* n, int i) {
+	void* x = n->slots[i];
+	if (!x) return NULL;
+	if (lnode_is_child(n, i)) ((lnode*)x)->refs++;
+	else lval_copy(x);
+	if (lnode_is_key(n, i)) lval_key_ref(x);
+	return x;
+}
+
+void lnode_del(lnode* n) {
+
+	if (--n->refs > 0) return;
+
+	gc_untrack(n->gc_slot);
+
+	int slots = n->kind >= LNODE_MAP ? n->count * 2 : n->count;
+	for (int i = 0; i < slots; i++) {
+		if (lnode_is_key(n, i)) lval_key_unref(n->slots[i]);
+		if (lnode_is_child(n, i)) lnode_del(n->slots[i]);
+		else if (n->slots[i]) lval_del(n->slots[i]);
+	}
+	free(n);
+}
+
+/* Applies 'f' to the elements under 'n', or to the values of map entries */
+void lnode_key_each(lnode* n, void (*f)(lval*)) {
+	if (!n) return;
+
+	int slots = n->kind >= LNODE_MAP ? n->count * 2 : n->count;
+	for (int i = 0; i < slots; i++) {
+		if (lnode_is_child(n, i)) lnode_key_each(n->slots[i], f);
+		else if (n->slots[i] && !lnode_is_key(n, i)) f(n->slots[i]);
+	}
+}
+
+/* Adds the elements under 'n' to 'out' in order, map entries as {key value} */
+void lnode_items(lnode* n, lval* out) {
+	if (!n) return;
+
+	for (int i = 0; i < n->count; i++) {
+		switch (n->kind) {
+		case LNODE_LEAF:
+			lval_add(out, lval_copy(n->slots[i]));
+			break;
+		case LNODE_BRANCH:
+			lnode_items(n->slots[i], out);
+			break;
+		default:
+			if (!n->slots[2 * i]) {
+				lnode_items(n->slots[2 * i + 1], out);
+			} else {
+				lval* pair = lval_qexpr();
+				lval_add(pair, lval_copy(n->slots[2 * i]));
+				lval_add(pair, lval_copy(n->slots[2 * i + 1]));
+				lval_add(out, pair);
+			}
+		}
+	}
+}
+
+lval* ltrie_items(lval* v) {
+	lval* x = lval_qexpr();
+	lnode_items(v->trie.root, x);
+	lnode_items(v->trie.tail, x);
+	return x;
+}
+
+lval* lval_pvec(void) {
+	lval* v = lval_alloc(LVAL_PVEC);
+	v->trie.count = 0;
+	v->trie.shift = PTRIE_BITS;
+	v->trie.root = NULL;
+	v->trie.tail = NULL;
+	return v;
+}
+
+lval* lval_pmap(void) {
+	lval* v = lval_pvec();
+	v->type = LVAL_PMAP;
+	return v;
+}
+
+/* A new version of 'v' with the trie parts given, sharing the rest */
+lval* ltrie_version(lval* v, int count, lnode* root, lnode* tail) {
+	lval* x = v->type == LVAL_PVEC ? lval_pvec() : lval_pmap();
+	x->trie.count = count;
+	x->trie.shift = v->trie.shift;
+	x->trie.root = root;
+	x->trie.tail = tail;
+	if (!root && v->trie.root) (x->trie.root = v->trie.root)->refs++;
+	if (!tail && v->trie.tail) (x->trie.tail = v->trie.tail)->refs++;
+	return x;
+}
+
+/* Index of a vector's first element in its tail */
+int lpvec_tail_start(ltrie* t) {
+	return t->count < PTRIE_WIDTH ? 0 : ((t->count - 1) >> PTRIE_BITS) << PTRIE_BITS;
+}
+
+lval* lpvec_nth(lval* v, int i) {
+	ltrie* t = &v->trie;
+	if (i >= lpvec_tail_start(t)) return t->tail->slots[i & PTRIE_MASK];
+
+	lnode* n = t->root;
+	for (int level = t->shift; level > 0; level -= PTRIE_BITS) {
+		n = n->slots[(i >> level) & PTRIE_MASK];
+	}
+	return n->slots[i & PTRIE_MASK];
+}
+
+/* A chain of single-child branches from 'level' bits down to 'leaf' */
+lnode* lpvec_path(int level, lnode* leaf) {
+	if (level == 0) return leaf;
+	lnode* n = lnode_new(LNODE_BRANCH, 1);
+	n->slots[0] = lpvec_path(level - PTRIE_BITS, leaf);
+	return n;
+}
+
+/* Copies the rightmost path of a vector of 'count' elements, hanging the full 'leaf' off its end */
+lnode* lpvec_push_leaf(int count, int level, lnode* parent, lnode* leaf) {
+	int i = ((count - 1) >> level) & PTRIE_MASK;
+	lnode* n = lnode_new(LNODE_BRANCH, i < parent->count ? parent->count : i + 1);
+	for (int j = 0; j < parent->count; j++) {
+		if (j != i) n->slots[j] = lnode_share(parent, j);
+	}
+
+	if (level == PTRIE_BITS) n->slots[i] = leaf;
+	else if (i < parent->count) n->slots[i] = lpvec_push_leaf(count, level - PTRIE_BITS, parent->slots[i], leaf);
+	else n->slots[i] = lpvec_path(level - PTRIE_BITS, leaf);
+	return n;
+}
+
+/* 'v' with 'x' appended, consuming 'x' */
+lval* lpvec_conj(lval* v, lval* x) {
+	ltrie* t = &v->trie;
+
+	/* Room left in the tail */
+	if (t->count - lpvec_tail_start(t) < PTRIE_WIDTH) {
+		int n = t->tail ? t->tail->count : 0;
+		lnode* tail = lnode_new(LNODE_LEAF, n + 1);
+		for (int i = 0; i < n; i++) tail->slots[i] = lnode_share(t->tail, i);
+		tail->slots[n] = x;
+		return ltrie_version(v, t->count + 1, NULL, tail);
+	}
+
+	/* Push the full tail into the trie, growing a level when the root is full */
+	t->tail->refs++;
+	lnode* root;
+	int shift = t->shift;
+	if (!t->root) {
+		root = lpvec_path(PTRIE_BITS, t->tail);
+	} else if ((t->count >> PTRIE_BITS) > (1 << t->shift)) {
+		root = lnode_new(LNODE_BRANCH, 2);
+		root->slots[0] = t->root;
+		t->root->refs++;
+		root->slots[1] = lpvec_path(t->shift, t->tail);
+		shift += PTRIE_BITS;
+	} else {
+		root = lpvec_push_leaf(t->count, t->shift, t->root, t->tail);
+	}
+
+	lnode* tail = lnode_new(LNODE_LEAF, 1);
+	tail->slots[0] = x;
+
+	lval* r = ltrie_version(v, t->count + 1, root, tail);
+	r->trie.shift = shift;
+	return r;
+}
+
+/* A copy of 'n' at 'level' bits with element 'i' replaced by 'x' */
+lnode* lpvec_assoc_node(lnode* n, int level, int i, lval* x) {
+	int j = (i >> level) & PTRIE_MASK;
+	lnode* r = lnode_new(n->kind, n->count);
+	for (int k = 0; k < n->count; k++) {
+		if (k != j) r->slots[k] = lnode_share(n, k);
+	}
+	r->slots[j] = level == 0 ? (void*)x : (void*)lpvec_assoc_node(n->slots[j], level - PTRIE_BITS, i, x);
+	return r;
+}
+
+/* 'v' with element 'i' replaced by 'x', consuming 'x'; 'i' may be one past the end */
+lval* lpvec_assoc(lval* v, int i, lval* x) {
+	ltrie* t = &v->trie;
+	if (i == t->count) return lpvec_conj(v, x);
+	if (i >= lpvec_tail_start(t)) return ltrie_version(v, t->count, NULL, lpvec_assoc_node(t->tail, 0, i, x));
+	return ltrie_version(v, t->count, lpvec_assoc_node(t->root, t->shift, i, x), NULL);
+}
+
+unsigned lpmap_hash(lval* k) {
+	return (unsigned)lval_hash(k);
+}
+
+/* Position of the entry for 'bit' among those present in a map node */
+int lpmap_index(lnode* n, unsigned bit) {
+	return __builtin_popcount(n->bitmap & (bit - 1));
+}
+
+/* The value bound to 'k' in the trie under 'n', or NULL */
+lval* lpmap_find(lnode* n, unsigned h, lval* k) {
+	int shift = 0;
+	while (n) {
+		if (n->kind == LNODE_COLLISION) {
+			for (int i = 0; i < n->count; i++) {
+				if (lval_eq(n->slots[2 * i], k)) return n->slots[2 * i + 1];
+			}
+			return NULL;
+		}
+
+		unsigned bit = 1u << ((h >> shift) & PTRIE_MASK);
+		if (!(n->bitmap & bit)) return NULL;
+
+		int i = lpmap_index(n, bit);
+		lval* key = n->slots[2 * i];
+		if (key) return lval_eq(key, k) ? n->slots[2 * i + 1] : NULL;
+
+		n = n->slots[2 * i + 1];
+		shift += PTRIE_BITS;
+	}
+	return NULL;
+}
+
+/* A node at 'shift' bits holding two entries whose keys differ */
+lnode* lpmap_pair(int shift, lval* k1, lval* v1, unsigned h1, lval* k2, lval* v2, unsigned h2) {
+	lnode* n;
+
+	if (h1 == h2) {
+		n = lnode_new(LNODE_COLLISION, 2);
+		n->hash = h1;
+		n->slots[0] = k1;
+		n->slots[1] = v1;
+		n->slots[2] = k2;
+		n->slots[3] = v2;
+		return n;
+	}
+
+	/* Hashes that differ do so within 32 bits, so this stops by shift 30 */
+	unsigned c1 = (h1 >> shift) & PTRIE_MASK;
+	unsigned c2 = (h2 >> shift) & PTRIE_MASK;
+	if (c1 == c2) {
+		n = lnode_new(LNODE_MAP, 1);
+		n->bitmap = 1u << c1;
+		n->slots[0] = NULL;
+		n->slots[1] = lpmap_pair(shift + PTRIE_BITS, k1, v1, h1, k2, v2, h2);
+		return n;
+	}
+
+	n = lnode_new(LNODE_MAP, 2);
+	n->bitmap = (1u << c1) | (1u << c2);
+	int first = c1 < c2 ? 0 : 2;
+	n->slots[first] = k1;
+	n->slots[first + 1] = v1;
+	n->slots[2 - first] = k2;
+	n->slots[3 - first] = v2;
+	return n;
+}
+
+/* A copy of 'n' with every entry but 'skip' shared and room for 'extra' more after 'at' */
+lnode* lpmap_copy(lnode* n, int skip, int at, int extra) {
+	lnode* r = lnode_new(n->kind, n->count - (skip != -1) + extra);
+	r->bitmap = n->bitmap;
+	r->hash = n->hash;
+
+	int j = 0;
+	for (int i = 0; i < n->count; i++) {
+		if (i == at) j += extra;
+		if (i == skip) continue;
+		r->slots[2 * j] = lnode_share(n, 2 * i);
+		r->slots[2 * j + 1] = lnode_share(n, 2 * i + 1);
+		j++;
+	}
+	return r;
+}
+
+/* The trie under 'n' with 'k' bound to 'v', consuming both */
+lnode* lpmap_assoc(lnode* n, int shift, unsigned h, lval* k, lval* v) {
+
+	if (!n) {
+		n = lnode_new(LNODE_MAP, 1);
+		n->bitmap = 1u << ((h >> shift) & PTRIE_MASK);
+		n->slots[0] = k;
+		n->slots[1] = v;
+		return n;
+	}
+
+	if (n->kind == LNODE_COLLISION) {
+		if (h != n->hash) {
+			/* Move the colliding keys a level down behind a map node */
+			lnode* m = lnode_new(LNODE_MAP, 1);
+			m->bitmap = 1u << ((n->hash >> shift) & PTRIE_MASK);
+			m->slots[0] = NULL;
+			m->slots[1] = n;
+			n->refs++;
+			lnode* r = lpmap_assoc(m, shift, h, k, v);
+			lnode_del(m);
+			return r;
+		}
+
+		for (int i = 0; i < n->count; i++) {
+			if (!lval_eq(n->slots[2 * i], k)) continue;
+			lnode* r = lpmap_copy(n, i, i, 1);
+			r->slots[2 * i] = k;
+			r->slots[2 * i + 1] = v;
+			return r;
+		}
+		lnode* r = lpmap_copy(n, -1, n->count, 1);
+		r->slots[2 * n->count] = k;
+		r->slots[2 * n->count + 1] = v;
+		return r;
+	}
+
+	unsigned bit = 1u << ((h >> shift) & PTRIE_MASK);
+	int i = lpmap_index(n, bit);
+
+	if (!(n->bitmap & bit)) {
+		lnode* r = lpmap_copy(n, -1, i, 1);
+		r->bitmap |= bit;
+		r->slots[2 * i] = k;
+		r->slots[2 * i + 1] = v;
+		return r;
+	}
+
+	lval* key = n->slots[2 * i];
+	lnode* r = lpmap_copy(n, i, i, 1);
+
+	if (!key) {
+		r->slots[2 * i] = NULL;
+		r->slots[2 * i + 1] = lpmap_assoc(n->slots[2 * i + 1], shift + PTRIE_BITS, h, k, v);
+	} else if (lval_eq(key, k)) {
+		r->slots[2 * i] = k;
+		r->slots[2 * i + 1] = v;
+	} else {
+		r->slots[2 * i] = NULL;
+		r->slots[2 * i + 1] = lpmap_pair(shift + PTRIE_BITS, lnode_share(n, 2 * i), lnode_share(n, 2 * i + 1),
+			lpmap_hash(key), k, v, h);
+	}
+	return r;
+}
+
+/* The trie under 'n' without 'k', which must be in it; NULL once nothing is left */
+lnode* lpmap_dissoc(lnode* n, int shift, unsigned h, lval* k) {
+
+	if (n->kind == LNODE_COLLISION) {
+		int i = 0;
+		while (!lval_eq(n->slots[2 * i], k)) i++;
+		return n->count == 1 ? NULL : lpmap_copy(n, i, -1, 0);
+	}
+
+	unsigned bit = 1u << ((h >> shift) & PTRIE_MASK);
+	int i = lpmap_index(n, bit);
+
+	if (!n->slots[2 * i]) {
+		lnode* child = lpmap_dissoc(n->slots[2 * i + 1], shift + PTRIE_BITS, h, k);
+		if (child) {
+			lnode* r = lpmap_copy(n, i, i, 1);
+			r->slots[2 * i] = NULL;
+			r->slots[2 * i + 1] = child;
+			return r;
+		}
+	}
+
+	if (n->count == 1) return NULL;
+	lnode* r = lpmap_copy(n, i, -1, 0);
+	r->bitmap &= ~bit;
+	return r;
+}
+
+/* 'm' with 'k' bound to 'v', consuming both */
+lval* lpmap_assoc_val(lval* m, lval* k, lval* v) {
+	lval_key_ref(k);
+	unsigned h = lpmap_hash(k);
+	int count = m->trie.count + !lpmap_find(m->trie.root, h, k);
+	lnode* root = lpmap_assoc(m->trie.root, 0, h, k, v);
+	return ltrie_version(m, count, root, NULL);
+}
+
+lval* lpmap_dissoc_val(lval* m, lval* k) {
+	unsigned h = lpmap_hash(k);
+	if (!lpmap_find(m->trie.root, h, k)) return lval_copy(m);
+
+	lnode* root = lpmap_dissoc(m->trie.root, 0, h, k);
+	lval* x = lval_pmap();
+	x->trie.count = m->trie.count - 1;
+	x->trie.root = root;
+	return x;
+}
+
+int ltrie_eq(lval* x, lval* y) {
+	if (x->trie.count != y->trie.count) return 0;
+
+	if (x->type == LVAL_PVEC) {
+		for (int i = 0; i < x->trie.count; i++) {
+			if (!lval_eq(lpvec_nth(x, i), lpvec_nth(y, i))) return 0;
+		}
+		return 1;
+	}
+
+	lval* items = ltrie_items(x);
+	int eq = 1;
+	for (int i = 0; eq && i < items->count; i++) {
+		lval* k = items->cell[i]->cell[0];
+		lval* v = lpmap_find(y->trie.root, lpmap_hash(k), k);
+		eq = v && lval_eq(v, items->cell[i]->cell[1]);
+	}
+	lval_del(items);
+	return eq;
+}
+
+void lval_print_hash(lval* v) {
+	printf(v->type == LVAL_MAP ? "#map{" : "#set{");
+	int first = 1;
+	for (int i = 0; i < v->hash->used; i++) {
+		if (!v->hash->keys[i]) continue;
+		if (!first) printf(v->hash->is_map ? ", " : " ");
+		first = 0;
+		lval_print(v->hash->keys[i]);
+		if (v->hash->is_map) {
+			putchar(' ');
+			lval_print(v->hash->vals[i]);
+		}
+	}
+	putchar('}');
+}
+
+void lval_print_trie(lval* v) {
+	printf(v->type == LVAL_PVEC ? "#pvec[" : "#pmap{");
+	lval* items = ltrie_items(v);
+	for (int i = 0; i < items->count; i++) {
+		if (v->type == LVAL_PVEC) {
+			lval_print(items->cell[i]);
+			if (i != items->count - 1) putchar(' ');
+		} else {
+			lval_print(items->cell[i]->cell[0]);
+			putchar(' ');
+			lval_print(items->cell[i]->cell[1]);
+			if (i != items->count - 1) printf(", ");
+		}
+	}
+	lval_del(items);
+	putchar(v->type == LVAL_PVEC ? ']' : '}');
+}
+
+void lval_print_rec(lval* v) {
+	printf("#%s{", v->rtype->cell[0]->sym);
+	for (int i = 1; i < v->rtype->count; i++) {
+		printf("%s ", v->rtype->cell[i]->sym);
+		lval_print(v->fields[i - 1]);
+		if (i != v->rtype->count - 1) printf(", ");
+	}
+	putchar('}');
+}
+
+/* Matrices separate their rows with ';' */
+void lval_print_arr(lval* v) {
+	printf(v->arr.kind == LARR_I64 ? "i64[" : "f64[");
+	for (int i = 0; i < v->arr.count; i++) {
+		if (v->arr.kind == LARR_I64) printf("%lli", v->arr.i64[i]);
+		else printf("%.2f", v->arr.f64[i]);
+		if (i == v->arr.count - 1) break;
+		printf(v->arr.cols && (i + 1) % v->arr.cols == 0 ? "; " : " ");
+	}
+	putchar(']');
+}
+
+void lval_expr_print(lval* v, char open, char close) {
+	putchar(open);
+	for (int i = 0; i < v->count; i++) {
+
+		lval_print(v->cell[i]);
+
+		if (i != (v->count - 1)) putchar(' ');
+	}
+	putchar(close);
+}
+
+/* The escapes of mpc's C string table, or NULL if 'c' prints as itself */
+const char* lstr_escape(char c) {
+	switch (c) {
+	case '\a': return "\\a";
+	case '\b': return "\\b";
+	case '\f': return "\\f";
+	case '\n': return "\\n";
+	case '\r': return "\\r";
+	case '\t': return "\\t";
+	case '\v': return "\\v";
+	case '\\': return "\\\\";
+	case '\'': return "\\'";
+	case '"': return "\\\"";
+	case '\0': return "\\0";
+	}
+	return NULL;
+}
+
+/* Runs that need no escaping are written straight from the string in one go */
+void lval_print_str(lval* v) {
+	char* s = lstr_chars(v);
+	long i = 0;
+
+	putchar('"');
+	while (i < v->len) {
+		long run = kernels.str_plain(s + i, v->len - i);
+		fwrite(s + i, 1, run, stdout);
+		i += run;
+		if (i == v->len) break;
+
+		const char* e = lstr_escape(s[i]);
+		if (e) fputs(e, stdout);
+		else putchar(s[i]);
+		i++;
+	}
+	putchar('"');
+}
+
+/* Peels off nine decimal digits at a time, most significant chunk printed first */
+void lval_print_big(lval* v) {
+	lbig x = lbig_copy(&v->big);
+	unsigned* chunks = malloc(sizeof(unsigned) * (x.size * 10 / 9 + 2));
+	int count = 0;
+
+	/* A big integer is never zero, so there is at least one chunk */
+	do {
+		chunks[count++] = mag_div_limb(x.limbs, x.size, 1000000000);
+		x.size = mag_trim(x.limbs, x.size);
+	} while (x.size > 0);
+
+	if (v->big.sign < 0) putchar('-');
+	printf("%u", chunks[count - 1]);
+	for (int i = count - 2; i >= 0; i--) printf("%09u", chunks[i]);
+
+	free(chunks);
+	lbig_free(&x);
+}
+
+void lval_print(lval* v) {
+
+	switch (v->type) {
+	case LVAL_NUM:
+		printf("%.2f", v->num);
+		break;
+	case LVAL_INT:
+		printf("%lli", v->integer);
+		break;
+	case LVAL_BIG:
+		lval_print_big(v);
+		break;
+	case LVAL_ARR:
+		lval_print_arr(v);
+		break;
+	case LVAL_MAP:
+	case LVAL_SET:
+		lval_print_hash(v);
+		break;
+	case LVAL_PVEC:
+	case LVAL_PMAP:
+		lval_print_trie(v);
+		break;
+	case LVAL_REC:
+		lval_print_rec(v);
+		break;
+	case LVAL_BOOL:
+		printf("%s", v->bool ? "true" : "false");
+		break;
+	case LVAL_ERR:
+		printf("Error: %s", v->err);
+		break;
+	case LVAL_SYM:
+		printf("%s", v->sym);
+		break;
+	case LVAL_STR:
+		lval_print_str(v);
+		break;
+	case LVAL_FUN:
+		if (v->builtin) {
+			printf("<function> %s", v->fun_name);
+		}
+		else {
+			printf("<function> %s ", v->fun_name);
+			printf("(\\ {");
+			/* Only the formals still waiting for an argument */
+			for (int i = v->env->bound; i < v->formals->count; i++) {
+				lval_print(v->formals->cell[i]);
+				if (i != v->formals->count - 1) putchar(' ');
+			}
+			printf("} ");
+			lval_print(v->body);
+			putchar(')');
+		}
+		break;
+	case LVAL_SEXPR:
+		lval_expr_print(v, '(', ')');
+		break;
+	case LVAL_QEXPR:
+		lval_expr_print(v, '{', '}');
+		break;
+	case LVAL_VEC:
+		lval_expr_print(v, '[', ']');
+		break;
+	}
+}
+
+void lval_println(lval* v) {
+	lval_print(v);
+	putchar('\n');
+}
+
+int lval_eq(lval* x, lval* y) {
+
+	/* Numbers compare by value; integers are normalized, so an LVAL_INT and
+	 * an LVAL_BIG are never equal */
+	if (x->type != y->type && lval_is_number(x) && lval_is_number(y)) {
+		if (lval_is_exact(x) && lval_is_exact(y)) return 0;
+		return lval_to_double(x) == lval_to_double(y);
+	}
+
+	if (x->type != y->type) return 0;
+
+	switch (x->type) {
+	case LVAL_NUM: return (x->num == y->num);
+	case LVAL_INT: return (x->integer == y->integer);
+	case LVAL_BIG: return lbig_cmp(&x->big, &y->big) == 0;
+	case LVAL_ARR:
+		if (x->arr.kind != y->arr.kind || x->arr.count != y->arr.count
+			|| x->arr.rows != y->arr.rows || x->arr.cols != y->arr.cols) return 0;
+		for (int i = 0; i < x->arr.count; i++) {
+			if (x->arr.kind == LARR_I64 ? x->arr.i64[i] != y->arr.i64[i] : x->arr.f64[i] != y->arr.f64[i]) return 0;
+		}
+		return 1;
+	case LVAL_BOOL: return (x->bool == y->bool);
+
+
+	case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
+	case LVAL_SYM: return (x->sym == y->sym);
+	case LVAL_STR: return lstr_eq(x, y);
+
+	case LVAL_FUN:
+		if (x->builtin || y->builtin) {
+			return x->builtin == y->builtin && x->body == y->body;
+		}
+		else {
+			return x->env->bound == y->env->bound
+				&& lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+		}
+
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+	case LVAL_VEC:
+		if (x->count != y->count) return 0;
+		for (int i = 0; i < x->count; i++) {
+			if (!lval_eq(x->cell[i], y->cell[i])) return 0;
+		}
+		return 1;
+		break;
+
+	case LVAL_MAP:
+	case LVAL_SET:
+		return lhash_eq(x->hash, y->hash);
+
+	case LVAL_PVEC:
+	case LVAL_PMAP:
+		return ltrie_eq(x, y);
+
+	/* Records of types made by separate defrecords differ even when their fields match */
+	case LVAL_REC:
+		if (x->rtype != y->rtype) return 0;
+		for (int i = 1; i < x->rtype->count; i++) {
+			if (!lval_eq(x->fields[i - 1], y->fields[i - 1])) return 0;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+lval* builtin_not(lenv* e, lval* a) {
+	LASSERT_NUM("!", a, 1);
+	LASSERT_TYPE("!", a, 0, LVAL_BOOL);
+
+	lval* x = lval_bool(!a->cell[0]->bool);
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+	LASSERT_NUM("if", a, 3);
+	LASSERT_TYPE("if", a, 0, LVAL_BOOL);
+	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+	lval* x = lval_eval_list(e, a->cell[a->cell[0]->bool ? 1 : 2]);
+
+	lval_del(a);
+	return x;
+}
+
+/* Arithmetic builtins fold their arguments left to right in one pass over the
+ * argument array. Integers fold into 'n' with 'int_step', which reads the
+ * next integer 'm' and clears 'ok' when the result would overflow or is not
+ * an integer. The fold then continues on the bignum 'b' with 'big_step',
+ * whose argument is 'w', and once a result is not an integer at all it
+ * continues in doubles with 'step', running value 'x' and next argument 'y'.
+ * A 'big_step' can instead set 'ok' to -1 once it has folded 'w' into 'x'
+ * itself. With 'negate' set a lone argument is folded into zero */
+#define LBUILTIN_ARITH(name, op, negate, int_step, big_step, step) \
+	lval* builtin_##name(lenv* e, lval* a) { \
+		LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", op); \
+		for (int i = 0; i < a->count; i++) { \
+			LASSERT_NUMBER(op, a, i); \
+		} \
+		int i = negate && a->count == 1 ? 0 : 1; \
+		lval* first = i ? a->cell[0] : lval_int(0); \
+		int exact = lval_is_exact(first); \
+		int big = first->type == LVAL_BIG; \
+		long long n = first->type == LVAL_INT ? first->integer : 0; \
+		lbig b = big ? lbig_copy(&first->big) : (lbig){ 0 }; \
+		double x = exact ? 0 : first->num; \
+		for (; i < a->count; i++) { \
+			lval* v = a->cell[i]; \
+			if (exact && !big && v->type == LVAL_INT) { \
+				long long m = v->integer; \
+				int ok = 1; \
+				int_step; \
+				if (ok) continue; \
+			} \
+			if (exact && lval_is_exact(v)) { \
+				if (!big) { \
+					b = lbig_from_int(n); \
+					big = 1; \
+				} \
+				unsigned tmp[2]; \
+				lbig w = lbig_view(v, tmp); \
+				int ok = 1; \
+				big_step; \
+				if (ok > 0) continue; \
+				if (ok < 0) { \
+					lbig_free(&b); \
+					exact = 0; \
+					continue; \
+				} \
+			} \
+			if (exact) { \
+				x = big ? lbig_to_double(&b) : (double)n; \
+				lbig_free(&b); \
+				exact = 0; \
+			} \
+			double y = lval_to_double(v); \
+			step; \
+		} \
+		lval_del(a); \
+		if (!exact) return lval_num(x); \
+		return big ? lval_big(b) : lval_int(n); \
+	}
+
+#define LDIV_CHECK(y) if ((y) == 0) { lbig_free(&b); lval_del(a); return lval_err("Division By Zero!"); }
+#define LDIV_RANGE(x) if (!isfinite(x)) { lbig_free(&b); lval_del(a); return lval_err("Quotient too large for a number!"); }
+
+LBUILTIN_ARITH(add, "+", 0, ok = lint_add(n, m, &n), ok = lbig_add(&b, &w), x += y)
+LBUILTIN_ARITH(sub, "-", 1, ok = lint_sub(n, m, &n), ok = lbig_sub(&b, &w), x -= y)
+LBUILTIN_ARITH(mul, "*", 0, ok = lint_mul(n, m, &n), ok = lbig_mul(&b, &w), x *= y)
+LBUILTIN_ARITH(div, "/", 0,
+	LDIV_CHECK(m) if (m == -1 ? n == LLONG_MIN : n % m != 0) ok = 0; else n /= m,
+	LDIV_CHECK(w.sign) if (!lbig_div(&b, &w, &x)) { LDIV_RANGE(x) ok = -1; },
+	LDIV_CHECK(y) x /= y)
+LBUILTIN_ARITH(mod, "%", 0,
+	LDIV_CHECK(m) n = m == -1 ? 0 : n % m,
+	LDIV_CHECK(w.sign) ok = lbig_mod(&b, &w),
+	LDIV_CHECK(y) x = fmod(x, y))
+LBUILTIN_ARITH(pow, "^", 0, ok = m >= 0 && lint_pow(n, m, &n), ok = lbig_pow(&b, &w), x = pow(x, y))
+LBUILTIN_ARITH(min, "min", 0, n = n < m ? n : m, ok = lbig_min(&b, &w), x = x < y ? x : y)
+LBUILTIN_ARITH(max, "max", 0, n = n > m ? n : m, ok = lbig_max(&b, &w), x = x > y ? x : y)
+
+/* Ordering builtins compare exactly two numbers with C operator 'cmp',
+ * exactly when both are integers */
+#define LBUILTIN_ORD(name, op, cmp) \
+	lval* builtin_##name(lenv* e, lval* a) { \
+		LASSERT_NUM(op, a, 2); \
+		LASSERT_NUMBER(op, a, 0); \
+		LASSERT_NUMBER(op, a, 1); \
+		lval* x = a->cell[0]; \
+		lval* y = a->cell[1]; \
+		int r; \
+		if (x->type == LVAL_INT && y->type == LVAL_INT) { \
+			r = x->integer cmp y->integer; \
+		} \
+		else if (lval_is_exact(x) && lval_is_exact(y)) { \
+			unsigned xt[2], yt[2]; \
+			lbig xb = lbig_view(x, xt), yb = lbig_view(y, yt); \
+			r = lbig_cmp(&xb, &yb) cmp 0; \
+		} \
+		else { \
+			r = lval_to_double(x) cmp lval_to_double(y); \
+		} \
+		lval_del(a); \
+		return lval_bool(r); \
+	}
+
+LBUILTIN_ORD(gt, ">", >)
+LBUILTIN_ORD(lt, "<", <)
+LBUILTIN_ORD(ge, ">=", >=)
+LBUILTIN_ORD(le, "<=", <=)
+
+/* The remaining comparisons take any two values, with 'r' computed from 'x' and 'y' */
+#define LBUILTIN_CMP(name, op, expr) \
+	lval* builtin_##name(lenv* e, lval* a) { \
+		LASSERT_NUM(op, a, 2); \
+		lval* x = a->cell[0]; \
+		lval* y = a->cell[1]; \
+		int r = expr; \
+		lval_del(a); \
+		return lval_bool(r); \
+	}
+
+LBUILTIN_CMP(eq, "==", lval_eq(x, y))
+LBUILTIN_CMP(ne, "!=", !lval_eq(x, y))
+LBUILTIN_CMP(and, "&&", x->bool && y->bool)
+LBUILTIN_CMP(or, "||", x->bool || y->bool)
+
+lval* builtin_len(lenv* e, lval* a) {
+	LASSERT_NUM("len", a, 1);
+
+	lval* v = a->cell[0];
+	if (v->type == LVAL_MAP || v->type == LVAL_SET || v->type == LVAL_PVEC || v->type == LVAL_PMAP) {
+		lval* x = lval_int(v->type == LVAL_MAP || v->type == LVAL_SET ? v->hash->count : v->trie.count);
+		lval_del(a);
+		return x;
+	}
+
+	LASSERT_SEQUENCE("len", a, 0);
+
+	lval* x = lval_int(lval_length(v));
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+
+	LASSERT_NUM("head", a, 1);
+	LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("head", a, 0)
+
+		lval* v = lval_take(a, 0);
+	return lval_slice(v, 0, 1);
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+
+	LASSERT_NUM("tail", a, 1);
+	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("tail", a, 0)
+
+		lval* v = lval_take(a, 0);
+	return lval_slice(v, 1, v->count - 1);
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+	a->type = LVAL_QEXPR;
+	return a;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+	LASSERT_NUM("head", a, 1);
+	LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+
+	lval* x = lval_take(a, 0);
+	lval* r = lval_eval_list(e, x);
+
+	lval_del(x);
+	return r;
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+	}
+
+	lval* x = lval_mut(lval_pop(a, 0));
+
+	while (a->count) {
+		x = lval_join(x, lval_pop(a, 0));
+	}
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_init(lenv* e, lval* a) {
+
+	LASSERT_NUM("init", a, 1);
+	LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("init", a, 0)
+
+		lval* v = lval_take(a, 0);
+	return lval_slice(v, 0, v->count - 1);
+}
+
+lval* builtin_cons(lenv* e, lval* a) {
+	LASSERT_NUM("cons", a, 2);
+	LASSERT_NUMBER("cons", a, 0);
+	LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("cons", a, 1);
+
+	lval* x = lval_pop(a, 0);
+	lval* xs = lval_mut(lval_take(a, 0));
+
+	return lval_push(xs, x);
+}
+
+/* Cells 'start' up to but not including 'end', sharing them with the list */
+lval* builtin_slice(lenv* e, lval* a) {
+	LASSERT_NUM("slice", a, 3);
+	LASSERT_TYPE("slice", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("slice", a, 1, LVAL_INT);
+	LASSERT_TYPE("slice", a, 2, LVAL_INT);
+
+	long long start = a->cell[1]->integer;
+	long long end = a->cell[2]->integer;
+	int count = a->cell[0]->count;
+	LASSERT(a, 0 <= start && start <= end && end <= count,
+		"Function 'slice' passed range %lli to %lli for a list of length %i.", start, end, count);
+
+	lval* v = lval_take(a, 0);
+	return lval_slice(v, start, end - start);
+}
+
+lval* builtin_vec(lenv* e, lval* a) {
+	a->type = LVAL_VEC;
+	return a;
+}
+
+/* Constant time for every sequence, they all keep their elements in an array */
+lval* builtin_nth(lenv* e, lval* a) {
+	LASSERT_NUM("nth", a, 2);
+	if (a->cell[0]->type != LVAL_PVEC) {
+		LASSERT_SEQUENCE("nth", a, 0);
+	}
+	LASSERT_INDEX("nth", a, 1, 0);
+
+	lval* v = a->cell[0];
+	int i = a->cell[1]->integer;
+	lval* x;
+	if (v->type == LVAL_PVEC) x = lval_copy(lpvec_nth(v, i));
+	else if (v->type != LVAL_ARR) x = lval_copy(v->cell[i]);
+	else if (v->arr.kind == LARR_I64) x = lval_int(v->arr.i64[i]);
+	else x = lval_num(v->arr.f64[i]);
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_store(lenv* e, lval* a, char* func, int in_place) {
+	LASSERT_NUM(func, a, 3);
+	LASSERT_TYPE(func, a, 0, LVAL_VEC);
+	LASSERT_INDEX(func, a, 1, 0);
+
+	int i = a->cell[1]->integer;
+	lval* x = lval_pop(a, 2);
+	lval* v = lval_take(a, 0);
+
+	/* 'vec-set' changes a copy, 'vec-set!' the vector every holder sees */
+	v = in_place ? lval_mut_in_place(v) : lval_mut(v);
+
+	lval_own_cells(v, 0, 0);
+	lval_del(v->cell[i]);
+	v->cell[i] = x;
+	return v;
+}
+
+lval* builtin_vec_set(lenv* e, lval* a) {
+	return builtin_store(e, a, "vec-set", 0);
+}
+
+lval* builtin_vec_set_in_place(lenv* e, lval* a) {
+	return builtin_store(e, a, "vec-set!", 1);
+}
+
+lval* builtin_push(lenv* e, lval* a) {
+	LASSERT_NUM("push", a, 2);
+	LASSERT_TYPE("push", a, 0, LVAL_VEC);
+
+	lval* x = lval_pop(a, 1);
+	lval* v = lval_mut(lval_take(a, 0));
+	return lval_add(v, x);
+}
+
+/* Builds a Map from {key value ...} or a Set from {item ...}, later keys win */
+lval* builtin_hash_new(lenv* e, lval* a, char* func) {
+	LASSERT_NUM(func, a, 1);
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_VEC,
+		"Function '%s' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+		func, ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC));
+
+	int is_map = strcmp(func, "hash-map") == 0;
+	lval* xs = a->cell[0];
+	LASSERT(a, !is_map || xs->count % 2 == 0,
+		"Function '%s' passed %i elements, Expected key value pairs.", func, xs->count);
+
+	lval* h = lval_hash_new(is_map ? LVAL_MAP : LVAL_SET);
+	for (int i = 0; i < xs->count; i += is_map ? 2 : 1) {
+		lhash_put(h->hash, lval_copy(xs->cell[i]), is_map ? lval_copy(xs->cell[i + 1]) : NULL);
+	}
+
+	lval_del(a);
+	return h;
+}
+
+lval* builtin_hash_map(lenv* e, lval* a) {
+	return builtin_hash_new(e, a, "hash-map");
+}
+
+lval* builtin_hash_set(lenv* e, lval* a) {
+	return builtin_hash_new(e, a, "hash-set");
+}
+
+/* The value stored under a key, or the default when one is given */
+lval* builtin_hash_get(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'hash-get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+	LASSERT_TYPE("hash-get", a, 0, LVAL_MAP);
+
+	lhash* h = a->cell[0]->hash;
+	lval* k = a->cell[1];
+	int i = lhash_find(h, k, lval_hash(k));
+
+	lval* x;
+	if (i != -1) {
+		x = lval_copy(h->vals[i]);
+	} else if (a->count == 3) {
+		x = lval_pop(a, 2);
+	} else {
+		x = lval_err("Key not found in Map.");
+	}
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_hash_has(lenv* e, lval* a) {
+	LASSERT_NUM("hash-has", a, 2);
+	LASSERT_HASH("hash-has", a, 0);
+
+	lval* k = a->cell[1];
+	lval* x = lval_bool(lhash_find(a->cell[0]->hash, k, lval_hash(k)) != -1);
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_hash_store(lenv* e, lval* a, char* func, int in_place) {
+	lval* h = a->cell[0];
+	int is_map = h->type == LVAL_MAP;
+	LASSERT(a, a->count == (is_map ? 3 : 2),
+		"Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", func, a->count, is_map ? 3 : 2);
+
+	lval* v = is_map ? lval_pop(a, 2) : NULL;
+	lval* k = lval_pop(a, 1);
+	h = lval_take(a, 0);
+
+	/* 'hash-put' changes a copy, 'hash-put!' the table every holder sees */
+	h = in_place ? lval_mut_in_place(h) : lval_mut(h);
+
+	lhash_put(h->hash, k, v);
+	return h;
+}
+
+lval* builtin_hash_put(lenv* e, lval* a) {
+	LASSERT_HASH("hash-put", a, 0);
+	return builtin_hash_store(e, a, "hash-put", 0);
+}
+
+lval* builtin_hash_put_in_place(lenv* e, lval* a) {
+	LASSERT_HASH("hash-put!", a, 0);
+	return builtin_hash_store(e, a, "hash-put!", 1);
+}
+
+lval* builtin_hash_remove(lenv* e, lval* a, char* func, int in_place) {
+	LASSERT_NUM(func, a, 2);
+	LASSERT_HASH(func, a, 0);
+
+	lval* k = lval_pop(a, 1);
+	lval* h = lval_take(a, 0);
+
+	h = in_place ? lval_mut_in_place(h) : lval_mut(h);
+
+	lhash_remove(h->hash, k);
+	lval_del(k);
+	return h;
+}
+
+lval* builtin_hash_del(lenv* e, lval* a) {
+	return builtin_hash_remove(e, a, "hash-del", 0);
+}
+
+lval* builtin_hash_del_in_place(lenv* e, lval* a) {
+	return builtin_hash_remove(e, a, "hash-del!", 1);
+}
+
+/* Lists the entries in the order they were first put */
+lval* builtin_hash_list(lenv* e, lval* a, char* func) {
+	LASSERT_NUM(func, a, 1);
+	LASSERT_HASH(func, a, 0);
+
+	lhash* h = a->cell[0]->hash;
+	LASSERT(a, h->is_map || strcmp(func, "hash-keys") == 0,
+		"Function '%s' passed a Set, Expected %s.", func, ltype_name(LVAL_MAP));
+
+	lval* x = lval_qexpr();
+	for (int i = 0; i < h->used; i++) {
+		if (!h->keys[i]) continue;
+		if (strcmp(func, "hash-keys") == 0) {
+			x = lval_add(x, lval_copy(h->keys[i]));
+		} else if (strcmp(func, "hash-vals") == 0) {
+			x = lval_add(x, lval_copy(h->vals[i]));
+		} else {
+			lval* pair = lval_qexpr();
+			pair = lval_add(pair, lval_copy(h->keys[i]));
+			pair = lval_add(pair, lval_copy(h->vals[i]));
+			x = lval_add(x, pair);
+		}
+	}
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_hash_keys(lenv* e, lval* a) {
+	return builtin_hash_list(e, a, "hash-keys");
+}
+
+lval* builtin_hash_vals(lenv* e, lval* a) {
+	return builtin_hash_list(e, a, "hash-vals");
+}
+
+lval* builtin_hash_items(lenv* e, lval* a) {
+	return builtin_hash_list(e, a, "hash-items");
+}
+
+/* Builds a Persistent Vector from {item ...} or a Persistent Map from {key value ...} */
+lval* builtin_persistent(lenv* e, lval* a, char* func) {
+	LASSERT_NUM(func, a, 1);
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_VEC,
+		"Function '%s' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+		func, ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC));
+
+	int is_map = strcmp(func, "pmap") == 0;
+	lval* xs = a->cell[0];
+	LASSERT(a, !is_map || xs->count % 2 == 0,
+		"Function '%s' passed %i elements, Expected key value pairs.", func, xs->count);
+
+	lval* v = is_map ? lval_pmap() : lval_pvec();
+	for (int i = 0; i < xs->count; i += is_map ? 2 : 1) {
+		lval* next = is_map ? lpmap_assoc_val(v, lval_copy(xs->cell[i]), lval_copy(xs->cell[i + 1]))
+			: lpvec_conj(v, lval_copy(xs->cell[i]));
+		lval_del(v);
+		v = next;
+	}
+
+	lval_del(a);
+	return v;
+}
+
+lval* builtin_pvec(lenv* e, lval* a) {
+	return builtin_persistent(e, a, "pvec");
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+	return builtin_persistent(e, a, "pmap");
+}
+
+/* Appends every further argument to a Persistent Vector */
+lval* builtin_conj(lenv* e, lval* a) {
+	LASSERT_TYPE("conj", a, 0, LVAL_PVEC);
+
+	lval* v = lval_pop(a, 0);
+	while (a->count) {
+		lval* next = lpvec_conj(v, lval_pop(a, 0));
+		lval_del(v);
+		v = next;
+	}
+
+	lval_del(a);
+	return v;
+}
+
+/* A new version with an index or key bound; a vector index may be one past the end */
+lval* builtin_assoc(lenv* e, lval* a) {
+	LASSERT_NUM("assoc", a, 3);
+	LASSERT(a, a->cell[0]->type == LVAL_PVEC || a->cell[0]->type == LVAL_PMAP,
+		"Function 'assoc' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+		ltype_name(a->cell[0]->type), ltype_name(LVAL_PVEC), ltype_name(LVAL_PMAP));
+
+	lval* v = a->cell[0];
+	lval* r;
+	if (v->type == LVAL_PVEC) {
+		LASSERT_TYPE("assoc", a, 1, LVAL_INT);
+		LASSERT(a, a->cell[1]->integer >= 0 && a->cell[1]->integer <= v->trie.count,
+			"Function 'assoc' passed index %lli for argument 1, out of range for length %i.",
+			a->cell[1]->integer, v->trie.count);
+		r = lpvec_assoc(v, a->cell[1]->integer, lval_pop(a, 2));
+	} else {
+		lval* x = lval_pop(a, 2);
+		r = lpmap_assoc_val(v, lval_pop(a, 1), x);
+	}
+
+	lval_del(a);
+	return r;
+}
+
+lval* builtin_dissoc(lenv* e, lval* a) {
+	LASSERT_NUM("dissoc", a, 2);
+	LASSERT_TYPE("dissoc", a, 0, LVAL_PMAP);
+
+	lval* r = lpmap_dissoc_val(a->cell[0], a->cell[1]);
+
+	lval_del(a);
+	return r;
+}
+
+/* The element at an index or the value bound to a key, or the default when one is given */
+lval* builtin_get(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+	LASSERT(a, a->cell[0]->type == LVAL_PVEC || a->cell[0]->type == LVAL_PMAP,
+		"Function 'get' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+		ltype_name(a->cell[0]->type), ltype_name(LVAL_PVEC), ltype_name(LVAL_PMAP));
+
+	lval* v = a->cell[0];
+	lval* k = a->cell[1];
+	lval* x = NULL;
+	if (v->type == LVAL_PMAP) {
+		x = lpmap_find(v->trie.root, lpmap_hash(k), k);
+	} else if (k->type == LVAL_INT && k->integer >= 0 && k->integer < v->trie.count) {
+		x = lpvec_nth(v, k->integer);
+	}
+
+	if (x) x = lval_copy(x);
+	else if (a->count == 3) x = lval_pop(a, 2);
+	else x = lval_err("Function 'get' found nothing at the given %s.", v->type == LVAL_PVEC ? "index" : "key");
+
+	lval_del(a);
+	return x;
+}
+
+/* The elements of a Persistent Vector, or the {key value} pairs of a Persistent Map */
+lval* builtin_items(lenv* e, lval* a) {
+	LASSERT_NUM("items", a, 1);
+	LASSERT(a, a->cell[0]->type == LVAL_PVEC || a->cell[0]->type == LVAL_PMAP,
+		"Function 'items' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+		ltype_name(a->cell[0]->type), ltype_name(LVAL_PVEC), ltype_name(LVAL_PMAP));
+
+	lval* x = ltrie_items(a->cell[0]);
+
+	lval_del(a);
+	return x;
+}
+
+/* Converts any sequence of numbers; i64 only takes integers that fit 64 bits */
+lval* builtin_array(lenv* e, lval* a, char* func) {
+	LASSERT_NUM(func, a, 1);
+	LASSERT_SEQUENCE(func, a, 0);
+
+	lval* x = a->cell[0];
+	int kind = strcmp(func, "i64") == 0 ? LARR_I64 : LARR_F64;
+	int n = lval_length(x);
+	lval* r = lval_arr(kind, n);
+	if (x->type == LVAL_ARR) {
+		r->arr.rows = x->arr.rows;
+		r->arr.cols = x->arr.cols;
+	}
+
+	for (int i = 0; i < n; i++) {
+		int exact;
+		long long k;
+		double d;
+
+		if (x->type == LVAL_ARR) {
+			exact = x->arr.kind == LARR_I64;
+			k = exact ? x->arr.i64[i] : 0;
+			d = exact ? (double)k : x->arr.f64[i];
+		}
+		else {
+			lval* y = x->cell[i];
+			if (!lval_is_number(y) || (kind == LARR_I64 && y->type != LVAL_INT)) {
+				lval* err = lval_err("Function '%s' passed %s at index %i, Expected %s.", func,
+					ltype_name(y->type), i, kind == LARR_I64 ? "a 64-bit Integer" : ltype_name(LVAL_NUM));
+				lval_del(r);
+				lval_del(a);
+				return err;
+			}
+			exact = y->type == LVAL_INT;
+			k = exact ? y->integer : 0;
+			d = lval_to_double(y);
+		}
+
+		if (kind == LARR_F64) {
+			r->arr.f64[i] = d;
+		}
+		else if (exact) {
+			r->arr.i64[i] = k;
+		}
+		else {
+			lval* err = lval_err("Function '%s' cannot convert an f64 Array.", func);
+			lval_del(r);
+			lval_del(a);
+			return err;
+		}
+	}
+
+	lval_del(a);
+	return r;
 }
 
-void lval_println(lval* v) {
-	lval_print(v);
-	putchar('\n');
+lval* builtin_i64(lenv* e, lval* a) {
+	return builtin_array(e, a, "i64");
 }
 
-int lval_eq(lval* x, lval* y) {
+lval* builtin_f64(lenv* e, lval* a) {
+	return builtin_array(e, a, "f64");
+}
 
-	if (x->type != y->type) return 0;
+lval* builtin_iota(lenv* e, lval* a) {
+	LASSERT_NUM("iota", a, 1);
+	LASSERT_TYPE("iota", a, 0, LVAL_INT);
 
-	switch (x->type) {
-	case LVAL_NUM: return (x->num == y->num);
-	case LVAL_BOOL: return (x->bool == y->bool);
+	long long n = a->cell[0]->integer;
+	LASSERT(a, n >= 0 && n <= INT_MAX, "Function 'iota' passed %lli, Expected a length from 0 to %i.", n, INT_MAX);
 
+	lval* r = lval_arr(LARR_I64, n);
+	for (int i = 0; i < n; i++) r->arr.i64[i] = i;
 
-	case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-	case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-	case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+	lval_del(a);
+	return r;
+}
 
-	case LVAL_FUN:
-		if (x->builtin || y->builtin) {
-			return x->builtin == y->builtin;
-		}
-		else {
-			return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-		}
+int larr_is_exact(lval* v) {
+	return v->type == LVAL_INT || (v->type == LVAL_ARR && v->arr.kind == LARR_I64);
+}
 
-	case LVAL_QEXPR:
-	case LVAL_SEXPR:
-		if (x->count != y->count) return 0;
-		for (int i = 0; i < x->count; i++) {
-			if (!lval_eq(x->cell[i], y->cell[i])) return 0;
+/* The elements as doubles, converted into a new buffer when they are integers */
+double* larr_f64(larr* x) {
+	if (x->kind == LARR_F64) return x->f64;
+
+	double* d = malloc(sizeof(double) * (x->count ? x->count : 1));
+	for (int i = 0; i < x->count; i++) d[i] = (double)x->i64[i];
+	return d;
+}
+
+/* Elementwise arithmetic on two Arrays of one length, or on an Array and a
+ * Number broadcast over it. Integers stay exact unless 'i64_op' is NULL */
+lval* builtin_vop(lenv* e, lval* a, char* op, lkernel_f64 f64_op, lkernel_i64 i64_op) {
+	LASSERT_NUM(op, a, 2);
+
+	lval* x = a->cell[0];
+	lval* y = a->cell[1];
+	int xs = x->type == LVAL_ARR;
+	int ys = y->type == LVAL_ARR;
+	LASSERT(a, (xs || lval_is_number(x)) && (ys || lval_is_number(y)) && (xs || ys),
+		"Function '%s' passed %s and %s, Expected two Arrays or an Array and a Number.",
+		op, ltype_name(x->type), ltype_name(y->type));
+
+	larr* shape = xs ? &x->arr : &y->arr;
+	int n = shape->count;
+	LASSERT(a, !xs || !ys || (x->arr.count == y->arr.count
+		&& x->arr.rows == y->arr.rows && x->arr.cols == y->arr.cols),
+		"Function '%s' passed Arrays of different shapes.", op);
+
+	int kind = i64_op && larr_is_exact(x) && larr_is_exact(y) ? LARR_I64 : LARR_F64;
+
+	/* An unshared operand of the right kind takes the result in place */
+	lval* r;
+	if (xs && x->refs == 1 && x->arr.kind == kind) r = lval_copy(x);
+	else if (ys && y->refs == 1 && y->arr.kind == kind) r = lval_copy(y);
+	else r = lval_arr(kind, n);
+	r->arr.rows = shape->rows;
+	r->arr.cols = shape->cols;
+
+	if (kind == LARR_I64) {
+		long long xv = xs ? 0 : x->integer;
+		long long yv = ys ? 0 : y->integer;
+		int ok = i64_op(r->arr.i64, xs ? x->arr.i64 : &xv, xs, ys ? y->arr.i64 : &yv, ys, n);
+		lval_del(a);
+		if (!ok) {
+			lval_del(r);
+			return lval_err("Integer overflow in '%s', convert with f64 first.", op);
 		}
-		return 1;
-		break;
+		return r;
 	}
 
-	return 0;
+	double xv = xs ? 0 : lval_to_double(x);
+	double yv = ys ? 0 : lval_to_double(y);
+	double* xp = xs ? larr_f64(&x->arr) : &xv;
+	double* yp = ys ? larr_f64(&y->arr) : &yv;
+	f64_op(r->arr.f64, xp, xs, yp, ys, n);
+	if (xs && x->arr.kind == LARR_I64) free(xp);
+	if (ys && y->arr.kind == LARR_I64) free(yp);
+
+	lval_del(a);
+	return r;
 }
 
-lval* builtin_not(lenv* e, lval* a) {
-	LASSERT_NUM("!", a, 1);
-	LASSERT_TYPE("!", a, 0, LVAL_BOOL);
+lval* builtin_vadd(lenv* e, lval* a) {
+	return builtin_vop(e, a, "v+", kernels.f64_add, kernels.i64_add);
+}
 
-	lval* x = lval_pop(a, 0);
+lval* builtin_vsub(lenv* e, lval* a) {
+	return builtin_vop(e, a, "v-", kernels.f64_sub, kernels.i64_sub);
+}
+
+lval* builtin_vmul(lenv* e, lval* a) {
+	return builtin_vop(e, a, "v*", kernels.f64_mul, kernels.i64_mul);
+}
+
+lval* builtin_vdiv(lenv* e, lval* a) {
+	return builtin_vop(e, a, "v/", kernels.f64_div, NULL);
+}
 
-	x->bool = !(x->bool);
+lval* builtin_vfold(lenv* e, lval* a, char* func) {
+	LASSERT_NUM(func, a, 1);
+	LASSERT_TYPE(func, a, 0, LVAL_ARR);
+
+	larr* x = &a->cell[0]->arr;
+	int sum = strcmp(func, "vsum") == 0;
+	int min = strcmp(func, "vmin") == 0;
+	LASSERT(a, x->count || sum, "Function '%s' passed an empty Array.", func);
+
+	lval* r;
+	if (x->kind == LARR_F64) {
+		if (sum) r = lval_num(kernels.f64_sum(x->f64, x->count));
+		else if (min) r = lval_num(kernels.f64_min(x->f64, x->count));
+		else r = lval_num(kernels.f64_max(x->f64, x->count));
+	}
+	else {
+		long long k;
+		if (!sum) r = lval_int(min ? kernels.i64_min(x->i64, x->count) : kernels.i64_max(x->i64, x->count));
+		else if (kernels.i64_sum(x->i64, x->count, &k)) r = lval_int(k);
+		else r = lval_err("Integer overflow in '%s', convert with f64 first.", func);
+	}
 
 	lval_del(a);
-	return x;
+	return r;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-	LASSERT_NUM("if", a, 3);
-	LASSERT_TYPE("if", a, 0, LVAL_BOOL);
-	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+lval* builtin_vsum(lenv* e, lval* a) {
+	return builtin_vfold(e, a, "vsum");
+}
 
-	lval* x;
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
+lval* builtin_vmin(lenv* e, lval* a) {
+	return builtin_vfold(e, a, "vmin");
+}
+
+lval* builtin_vmax(lenv* e, lval* a) {
+	return builtin_vfold(e, a, "vmax");
+}
 
-	if (a->cell[0]->bool) {
-		x = lval_eval(e, lval_pop(a, 1));
+lval* builtin_vdot(lenv* e, lval* a) {
+	LASSERT_NUM("vdot", a, 2);
+	LASSERT_TYPE("vdot", a, 0, LVAL_ARR);
+	LASSERT_TYPE("vdot", a, 1, LVAL_ARR);
+
+	larr* x = &a->cell[0]->arr;
+	larr* y = &a->cell[1]->arr;
+	LASSERT(a, x->count == y->count, "Function 'vdot' passed Arrays of different lengths. Got %i and %i.", x->count, y->count);
+
+	lval* r;
+	if (x->kind == LARR_I64 && y->kind == LARR_I64) {
+		long long k;
+		if (kernels.i64_dot(x->i64, y->i64, x->count, &k)) r = lval_int(k);
+		else r = lval_err("Integer overflow in 'vdot', convert with f64 first.");
 	}
 	else {
-		x = lval_eval(e, lval_pop(a, 2));
+		double* xp = larr_f64(x);
+		double* yp = larr_f64(y);
+		r = lval_num(kernels.f64_dot(xp, yp, x->count));
+		if (x->kind == LARR_I64) free(xp);
+		if (y->kind == LARR_I64) free(yp);
 	}
 
 	lval_del(a);
+	return r;
+}
+
+lval* builtin_reshape(lenv* e, lval* a) {
+	LASSERT_NUM("reshape", a, 3);
+	LASSERT_TYPE("reshape", a, 0, LVAL_ARR);
+	LASSERT_TYPE("reshape", a, 1, LVAL_INT);
+	LASSERT_TYPE("reshape", a, 2, LVAL_INT);
+
+	int n = a->cell[0]->arr.count;
+	long long rows = a->cell[1]->integer;
+	long long cols = a->cell[2]->integer;
+	LASSERT(a, cols > 0 && rows >= 0 && n % cols == 0 && rows == n / cols,
+		"Function 'reshape' cannot arrange %i elements as %lli x %lli.", n, rows, cols);
+
+	lval* x = lval_mut(lval_take(a, 0));
+	x->arr.rows = rows;
+	x->arr.cols = cols;
 	return x;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+/* {rows cols} of a matrix, {count} of a flat array */
+lval* builtin_shape(lenv* e, lval* a) {
+	LASSERT_NUM("shape", a, 1);
+	LASSERT_TYPE("shape", a, 0, LVAL_ARR);
 
-	for (int i = 0; i < a->count; i++) {
-		LASSERT_TYPE(op, a, i, LVAL_NUM);
+	larr* x = &a->cell[0]->arr;
+	lval* r = lval_qexpr();
+	if (x->rows >= 0) {
+		lval_add(r, lval_int(x->rows));
+		lval_add(r, lval_int(x->cols));
+	}
+	else {
+		lval_add(r, lval_int(x->count));
 	}
 
-	lval* x = lval_pop(a, 0);
+	lval_del(a);
+	return r;
+}
 
-	if ((strcmp(op, "-") == 0) && a->count == 0) x->num = -x->num;
+lval* builtin_transpose(lenv* e, lval* a) {
+	LASSERT_NUM("transpose", a, 1);
+	LASSERT_MATRIX("transpose", a, 0);
 
-	while (a->count > 0) {
+	larr* x = &a->cell[0]->arr;
+	lval* r = lval_arr(x->kind, x->count);
+	r->arr.rows = x->cols;
+	r->arr.cols = x->rows;
+	lmat_transpose(r->arr.i64, x->i64, x->rows, x->cols);
+
+	lval_del(a);
+	return r;
+}
 
-		lval* y = lval_pop(a, 0);
+/* Computed in f64 whatever the element types */
+lval* builtin_matmul(lenv* e, lval* a) {
+	LASSERT_NUM("matmul", a, 2);
+	LASSERT_MATRIX("matmul", a, 0);
+	LASSERT_MATRIX("matmul", a, 1);
+
+	larr* x = &a->cell[0]->arr;
+	larr* y = &a->cell[1]->arr;
+	int m = x->rows;
+	int k = x->cols;
+	int n = y->cols;
+	LASSERT(a, y->rows == k, "Function 'matmul' passed %i x %i and %i x %i, inner sizes must match.",
+		m, k, y->rows, n);
+	LASSERT(a, (size_t)m * n <= INT_MAX, "Function 'matmul' result of %i x %i is too large.", m, n);
+
+	double* xp = larr_f64(x);
+	double* yp = larr_f64(y);
+	lval* r = lval_arr(LARR_F64, m * n);
+	r->arr.rows = m;
+	r->arr.cols = n;
+	lmat_mul(r->arr.f64, xp, yp, m, n, k);
+	if (x->kind == LARR_I64) free(xp);
+	if (y->kind == LARR_I64) free(yp);
 
-		if (strcmp(op, "+") == 0) x->num += y->num;
-		if (strcmp(op, "-") == 0) x->num -= y->num;
-		if (strcmp(op, "*") == 0) x->num *= y->num;
-		if (strcmp(op, "/") == 0) {
-			if (y->num == 0) {
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("Division By Zero!");
-				break;
+	lval_del(a);
+	return r;
+}
+
+/* Exact when both are i64, one dot product per row of the matrix */
+lval* builtin_matvec(lenv* e, lval* a) {
+	LASSERT_NUM("matvec", a, 2);
+	LASSERT_MATRIX("matvec", a, 0);
+	LASSERT_TYPE("matvec", a, 1, LVAL_ARR);
+
+	larr* x = &a->cell[0]->arr;
+	larr* y = &a->cell[1]->arr;
+	int m = x->rows;
+	int k = x->cols;
+	LASSERT(a, y->count == k, "Function 'matvec' passed a matrix with %i columns and an Array of %i.", k, y->count);
+
+	lval* r;
+	if (x->kind == LARR_I64 && y->kind == LARR_I64) {
+		r = lval_arr(LARR_I64, m);
+		for (int i = 0; i < m; i++) {
+			if (!kernels.i64_dot(x->i64 + i * k, y->i64, k, &r->arr.i64[i])) {
+				lval_del(r);
+				lval_del(a);
+				return lval_err("Integer overflow in 'matvec', convert with f64 first.");
 			}
-			x->num /= y->num;
 		}
-		if (strcmp(op, "%") == 0) x->num = ((long)x->num % (long)y->num);
-		if (strcmp(op, "^") == 0) x->num = power(x->num, y->num);
-		if (strcmp(op, "min") == 0) x->num = (x->num < y->num) ? x->num : y->num;
-		if (strcmp(op, "max") == 0) x->num = (x->num > y->num) ? x->num : y->num;
-
-		lval_del(y);
+	}
+	else {
+		double* xp = larr_f64(x);
+		double* yp = larr_f64(y);
+		r = lval_arr(LARR_F64, m);
+		for (int i = 0; i < m; i++) r->arr.f64[i] = kernels.f64_dot(xp + i * k, yp, k);
+		if (x->kind == LARR_I64) free(xp);
+		if (y->kind == LARR_I64) free(yp);
 	}
 
 	lval_del(a);
-
-	return x;
+	return r;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-	LASSERT_NUM(op, a, 2);
 
-	int r;
+lval* builtin_var(lenv* e, lval* a, char* func) {
 
-	if (strcmp(op, "==") == 0) {
-		r = lval_eq(a->cell[0], a->cell[1]);
-	}
+	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
-	if (strcmp(op, "!=") == 0) {
-		r = !lval_eq(a->cell[0], a->cell[1]);
-	}
+	lval* syms = a->cell[0];
 
-	if (strcmp(op, "!") == 0) {
-		r = !(a->cell[0]->bool);
+	for (int i = 0; i < syms->count; i++) {
+		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+			"Function 'def' cannot define non-symbol. "
+			"Got %s, Expected %s.",
+			ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
 	}
 
-	if (strcmp(op, "&&") == 0) {
-		r = (a->cell[0]->bool) && (a->cell[1]->bool);
-	}
+	LASSERT(a, syms->count == a->count - 1, "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.", func, syms->count, a->count - 1);
+
+	for (int i = 0; i < syms->count; i++) {
 
-	if (strcmp(op, "||") == 0) {
-		r = (a->cell[0]->bool) || (a->cell[1]->bool);
+		if (strcmp(func, "def") == 0) {
+			lenv_def(e, syms->cell[i], a->cell[i + 1]);
+		}
+
+		if (strcmp(func, "=") == 0) {
+			lenv_put(e, syms->cell[i], a->cell[i + 1]);
+		}
 	}
 
 	lval_del(a);
-	return lval_bool(r);
+	return lval_sexpr();
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
+lval* builtin_def(lenv* e, lval* a) {
+	return builtin_var(e, a, "def");
+}
 
-	LASSERT_NUM(op, a, 2);
-	LASSERT_TYPE(op, a, 0, LVAL_NUM);
-	LASSERT_TYPE(op, a, 1, LVAL_NUM);
+lval* builtin_put(lenv* e, lval* a) {
+	return builtin_var(e, a, "=");
+}
 
-	int r;
+lval* builtin_print_all(lenv* e, lval* a) {
+	lval* x = lval_qexpr();
 
-	if (strcmp(op, ">") == 0) r = (a->cell[0]->num > a->cell[1]->num);
-	if (strcmp(op, "<") == 0) r = (a->cell[0]->num < a->cell[1]->num);
-	if (strcmp(op, ">=") == 0) r = (a->cell[0]->num >= a->cell[1]->num);
-	if (strcmp(op, "<=") == 0) r = (a->cell[0]->num <= a->cell[1]->num);
+	for (int i = 0; i < e->count; i++) {
+		printf("%s\n", e->syms[i]);
+	}
 
 	lval_del(a);
-	return lval_bool(r);
+	return x;
 }
 
-lval* builtin_and(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "&&");
-}
+/* Both take a single argument that is ignored, as in (gc {}), so that the
+ * call is not read as the function itself */
+lval* builtin_gc_stats(lenv* e, lval* a) {
+	LASSERT_NUM("gc-stats", a, 1);
 
-lval* builtin_or(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "||");
+	lval_del(a);
+	gc_print_stats();
+	return lval_sexpr();
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-	return builtin_ord(e, a, ">");
-}
+lval* builtin_gc(lenv* e, lval* a) {
+	LASSERT_NUM("gc", a, 1);
 
-lval* builtin_lt(lenv* e, lval* a) {
-	return builtin_ord(e, a, "<");
+	lval_del(a);
+	gc_collect();
+	return lval_sexpr();
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-	return builtin_ord(e, a, ">=");
-}
+lval* builtin_lambda(lenv* e, lval* a) {
+	LASSERT_NUM("\\", a, 2);
+	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
 
-lval* builtin_le(lenv* e, lval* a) {
-	return builtin_ord(e, a, "<=");
-}
+	for (int i = 0; i < a->cell[0]->count; i++) {
+		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM), "Cannot define non-symbol. Got %s, Expected %s.", ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+	}
+
+	lval* formals = lval_pop(a, 0);
+	lval* body = lval_pop(a, 0);
+	lval_del(a);
 
-lval* builtin_eq(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "==");
+	return lval_lambda(e, formals, body);
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "!=");
+/*
+ * (defrecord {point} {x y}) defines a constructor 'point', accessors 'point-x'
+ * and 'point-y' and a predicate 'is-point'. They are builtins carrying the
+ * record type {point x y}, and accessors also the field's slot, so no field
+ * is ever looked up by name once the record type is made.
+ */
+
+lval* builtin_rec_new(lenv* e, lval* a) {
+	lval* rtype = a->cell[0];
+	char* name = rtype->cell[0]->sym;
+	LASSERT(a, a->count == rtype->count,
+		"Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", name, a->count - 1, rtype->count - 1);
+
+	lval* r = lval_rec(rtype);
+	for (int i = 1; i < rtype->count; i++) {
+		r->fields[i - 1] = lval_copy(a->cell[i]);
+	}
+
+	lval_del(a);
+	return r;
 }
 
-lval* builtin_len(lenv* e, lval* a) {
-	LASSERT_NUM("len", a, 1);
-	LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+/* Passed {rtype slot} ahead of the record */
+lval* builtin_rec_get(lenv* e, lval* a) {
+	lval* rtype = a->cell[0]->cell[0];
+	int slot = a->cell[0]->cell[1]->integer;
+	char* name = rtype->cell[0]->sym;
+	char* field = rtype->cell[slot + 1]->sym;
+	LASSERT(a, a->count == 2,
+		"Function '%s-%s' passed incorrect number of arguments. Got %i, Expected 1.", name, field, a->count - 1);
+	LASSERT(a, a->cell[1]->type == LVAL_REC && a->cell[1]->rtype == rtype,
+		"Function '%s-%s' passed incorrect type for argument 0. Got %s, Expected %s.", name, field,
+		a->cell[1]->type == LVAL_REC ? a->cell[1]->rtype->cell[0]->sym : ltype_name(a->cell[1]->type), name);
 
-	lval* x = lval_num(a->cell[0]->count);
+	lval* x = lval_copy(a->cell[1]->fields[slot]);
 
 	lval_del(a);
 	return x;
 }
 
-lval* builtin_head(lenv* e, lval* a) {
+lval* builtin_rec_is(lenv* e, lval* a) {
+	lval* rtype = a->cell[0];
+	LASSERT(a, a->count == 2,
+		"Function 'is-%s' passed incorrect number of arguments. Got %i, Expected 1.", rtype->cell[0]->sym, a->count - 1);
 
-	LASSERT_NUM("head", a, 1);
-	LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("head", a, 0)
+	lval* x = lval_bool(a->cell[1]->type == LVAL_REC && a->cell[1]->rtype == rtype);
 
-		lval* v = lval_take(a, 0);
+	lval_del(a);
+	return x;
+}
 
-	while (v->count > 1) lval_del(lval_pop(v, 1));
-	return v;
+/* Binds 'name' to 'func' carrying 'data', consuming 'data' */
+void lenv_def_bound(lenv* e, char* name, lbuiltin func, lval* data) {
+	lval* k = lval_sym(name);
+	lval* f = lval_fun(func, name);
+	f->body = data;
+	lenv_def(e, k, f);
+	lval_del(k);
+	lval_del(f);
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
+lval* builtin_defrecord(lenv* e, lval* a) {
+	LASSERT_NUM("defrecord", a, 2);
+	LASSERT_TYPE("defrecord", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("defrecord", a, 1, LVAL_QEXPR);
+	LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+		"Function 'defrecord' passed incorrect name for argument 0. Expected a single %s.", ltype_name(LVAL_SYM));
+
+	lval* fields = a->cell[1];
+	LASSERT(a, fields->count != 0, "Function 'defrecord' passed {} for argument 1.");
+	for (int i = 0; i < fields->count; i++) {
+		LASSERT(a, fields->cell[i]->type == LVAL_SYM,
+			"Function 'defrecord' cannot define non-symbol field. Got %s, Expected %s.",
+			ltype_name(fields->cell[i]->type), ltype_name(LVAL_SYM));
+		for (int j = 0; j < i; j++) {
+			LASSERT(a, fields->cell[i]->sym != fields->cell[j]->sym,
+				"Function 'defrecord' passed field '%s' twice.", fields->cell[i]->sym);
+		}
+	}
 
-	LASSERT_NUM("tail", a, 1);
-	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("tail", a, 0)
+	lval* rtype = lval_mut(lval_pop(a, 0));
+	rtype = lval_join(rtype, lval_take(a, 0));
+	char* name = rtype->cell[0]->sym;
 
-		lval* v = lval_take(a, 0);
-	lval_del(lval_pop(v, 0));
+	lenv_def_bound(e, name, builtin_rec_new, lval_copy(rtype));
 
-	return v;
-}
+	char* buf = malloc(strlen(name) + 4);
+	sprintf(buf, "is-%s", name);
+	lenv_def_bound(e, buf, builtin_rec_is, lval_copy(rtype));
 
-lval* builtin_list(lenv* e, lval* a) {
-	a->type = LVAL_QEXPR;
-	return a;
-}
+	for (int i = 1; i < rtype->count; i++) {
+		buf = realloc(buf, strlen(name) + strlen(rtype->cell[i]->sym) + 2);
+		sprintf(buf, "%s-%s", name, rtype->cell[i]->sym);
 
-lval* builtin_eval(lenv* e, lval* a) {
-	LASSERT_NUM("head", a, 1);
-	LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+		lval* data = lval_qexpr();
+		lval_add(data, lval_copy(rtype));
+		lval_add(data, lval_int(i - 1));
+		lenv_def_bound(e, buf, builtin_rec_get, data);
+	}
 
-	lval* x = lval_take(a, 0);
-	x->type = LVAL_SEXPR;
-	return lval_eval(e, x);
+	free(buf);
+	lval_del(rtype);
+	return lval_sexpr();
 }
 
-lval* builtin_join(lenv* e, lval* a) {
+lval* builtin_print(lenv* e, lval* a) {
 
 	for (int i = 0; i < a->count; i++) {
-		LASSERT_TYPE("join", a, i, LVAL_QEXPR);
-	}
-
-	lval* x = lval_pop(a, 0);
-
-	while (a->count) {
-		x = lval_join(x, lval_pop(a, 0));
+		lval_print(a->cell[i]);
+		putchar(' ');
 	}
 
+	putchar('\n');
 	lval_del(a);
-	return x;
-}
 
-lval* builtin_init(lenv* e, lval* a) {
+	return lval_sexpr();
+}
 
-	LASSERT_NUM("init", a, 1);
-	LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("init", a, 0)
+lval* builtin_error(lenv* e, lval* a) {
+	LASSERT_NUM("error", a, 1);
+	LASSERT_TYPE("error", a, 0, LVAL_STR);
 
-		lval* v = lval_take(a, 0);
-	lval_del(lval_pop(v, v->count - 1));
+	lval* err = lval_err(lval_str_flat(a->cell[0]));
 
-	return v;
+	lval_del(a);
+	return err;
 }
 
-lval* builtin_cons(lenv* e, lval* a) {
-	LASSERT_NUM("cons", a, 2);
-	LASSERT_TYPE("cons", a, 0, LVAL_NUM);
-	LASSERT_NOT_EMPTY("cons", a, 0);
-	LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("cons", a, 1);
-
-	lval* result = lval_qexpr();
-	lval* v = lval_pop(a, 0);
-
-	a = lval_pop(a, 0);
+/* Concatenates its arguments, sharing them as a rope rather than copying */
+lval* builtin_str_append(lenv* e, lval* a) {
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_TYPE("str-append", a, i, LVAL_STR);
+	}
 
-	result = lval_add(result, v);
-	result = lval_join(result, a);
+	lval* x = lval_pop(a, 0);
+	while (a->count) {
+		x = lval_str_concat(x, lval_pop(a, 0));
+	}
 
-	return result;
+	lval_del(a);
+	return x;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-	return builtin_op(e, a, "+");
-}
+/* Joins a list of strings with 'sep' between them, copying each piece once */
+lval* lstr_join(lval* a, char* func, lval* sep, lval* xs) {
+	for (int i = 0; i < xs->count; i++) {
+		LASSERT(a, xs->cell[i]->type == LVAL_STR,
+			"Function '%s' passed %s at index %i, Expected %s.", func,
+			ltype_name(xs->cell[i]->type), i, ltype_name(LVAL_STR));
+	}
 
-lval* builtin_sub(lenv* e, lval* a) {
-	return builtin_op(e, a, "-");
-}
+	long sep_len = sep ? sep->len : 0;
+	long len = xs->count ? sep_len * (xs->count - 1) : 0;
+	for (int i = 0; i < xs->count; i++) len += xs->cell[i]->len;
 
-lval* builtin_mul(lenv* e, lval* a) {
-	return builtin_op(e, a, "*");
-}
+	char* s = malloc(len + 1);
+	long pos = 0;
+	for (int i = 0; i < xs->count; i++) {
+		if (i && sep_len) {
+			memcpy(s + pos, lstr_chars(sep), sep_len);
+			pos += sep_len;
+		}
+		memcpy(s + pos, lstr_chars(xs->cell[i]), xs->cell[i]->len);
+		pos += xs->cell[i]->len;
+	}
+	s[pos] = '\0';
 
-lval* builtin_div(lenv* e, lval* a) {
-	return builtin_op(e, a, "/");
+	lval_del(a);
+	return lval_str_take(s, len);
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-	return builtin_op(e, a, "%");
-}
+lval* builtin_str_join(lenv* e, lval* a) {
+	LASSERT_NUM("str-join", a, 2);
+	LASSERT_TYPE("str-join", a, 0, LVAL_STR);
+	LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_VEC,
+		"Function 'str-join' passed incorrect type for argument 1. Got %s, Expected %s or %s.",
+		ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC));
 
-lval* builtin_pow(lenv* e, lval* a) {
-	return builtin_op(e, a, "^");
+	return lstr_join(a, "str-join", a->cell[0], a->cell[1]);
 }
 
-lval* builtin_min(lenv* e, lval* a) {
-	return builtin_op(e, a, "min");
-}
+/* Turns the pieces a script collected into one string in a single pass */
+lval* builtin_str_build(lenv* e, lval* a) {
+	LASSERT_NUM("str-build", a, 1);
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_VEC,
+		"Function 'str-build' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+		ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC));
 
-lval* builtin_max(lenv* e, lval* a) {
-	return builtin_op(e, a, "max");
+	return lstr_join(a, "str-build", NULL, a->cell[0]);
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-
-	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-
-	lval* syms = a->cell[0];
-
-	for (int i = 0; i < syms->count; i++) {
-		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-			"Function 'def' cannot define non-symbol. "
-			"Got %s, Expected %s.",
-			ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
-	}
-
-	LASSERT(a, syms->count == a->count - 1, "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.", func, syms->count, a->count - 1);
+lval* builtin_str_len(lenv* e, lval* a) {
+	LASSERT_NUM("str-len", a, 1);
+	LASSERT_TYPE("str-len", a, 0, LVAL_STR);
 
-	for (int i = 0; i < syms->count; i++) {
+	lval* x = lval_int(a->cell[0]->len);
 
-		if (strcmp(func, "def") == 0) {
-			lenv_def(e, syms->cell[i], a->cell[i + 1]);
-		}
+	lval_del(a);
+	return x;
+}
 
-		if (strcmp(func, "=") == 0) {
-			lenv_put(e, syms->cell[i], a->cell[i + 1]);
-		}
-	}
+/* Characters 'start' up to but not including 'end', sharing them with the string */
+lval* builtin_substr(lenv* e, lval* a) {
+	LASSERT_NUM("substr", a, 3);
+	LASSERT_TYPE("substr", a, 0, LVAL_STR);
+	LASSERT_TYPE("substr", a, 1, LVAL_INT);
+	LASSERT_TYPE("substr", a, 2, LVAL_INT);
+
+	long long start = a->cell[1]->integer;
+	long long end = a->cell[2]->integer;
+	long len = a->cell[0]->len;
+	LASSERT(a, 0 <= start && start <= end && end <= len,
+		"Function 'substr' passed range %lli to %lli for a string of length %li.", start, end, len);
+
+	lval* x = lval_substr(a->cell[0], start, end - start);
 
 	lval_del(a);
-	return lval_sexpr();
+	return x;
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-	return builtin_var(e, a, "def");
+/* Index of the first 'needle' in 's' at or after 'from', or -1 */
+long lstr_find(lval* s, lval* needle, long from) {
+	if (needle->len == 0) return from;
+	long i = kernels.str_find(lstr_chars(s) + from, s->len - from, lstr_chars(needle), needle->len);
+	return i < 0 ? -1 : from + i;
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-	return builtin_var(e, a, "=");
+lval* builtin_str_find(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'str-find' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+	LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+	LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+
+	long from = 0;
+	if (a->count == 3) {
+		LASSERT_TYPE("str-find", a, 2, LVAL_INT);
+		LASSERT(a, a->cell[2]->integer >= 0 && a->cell[2]->integer <= a->cell[0]->len,
+			"Function 'str-find' passed index %lli for argument 2, out of range for length %li.",
+			a->cell[2]->integer, a->cell[0]->len);
+		from = a->cell[2]->integer;
+	}
+
+	lval* x = lval_int(lstr_find(a->cell[0], a->cell[1], from));
+
+	lval_del(a);
+	return x;
 }
 
-lval* builtin_print_all(lenv* e, lval* a) {
+/* The pieces between separators, as substrings sharing the string's characters */
+lval* builtin_str_split(lenv* e, lval* a) {
+	LASSERT_NUM("str-split", a, 2);
+	LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+	LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+	LASSERT(a, a->cell[1]->len != 0, "Function 'str-split' passed \"\" for argument 1.");
+
+	lval* s = a->cell[0];
+	lval* sep = a->cell[1];
 	lval* x = lval_qexpr();
 
-	for (int i = 0; i < e->count; i++) {
-		printf("%s\n", e->syms[i]);
+	long start = 0;
+	long i;
+	while ((i = lstr_find(s, sep, start)) != -1) {
+		x = lval_add(x, lval_substr(s, start, i - start));
+		start = i + sep->len;
 	}
+	x = lval_add(x, lval_substr(s, start, s->len - start));
 
 	lval_del(a);
 	return x;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-	LASSERT_NUM("\\", a, 2);
-	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+/* Every 'old' replaced by 'new', building the result in one allocation */
+lval* builtin_str_replace(lenv* e, lval* a) {
+	LASSERT_NUM("str-replace", a, 3);
+	LASSERT_TYPE("str-replace", a, 0, LVAL_STR);
+	LASSERT_TYPE("str-replace", a, 1, LVAL_STR);
+	LASSERT_TYPE("str-replace", a, 2, LVAL_STR);
+	LASSERT(a, a->cell[1]->len != 0, "Function 'str-replace' passed \"\" for argument 1.");
+
+	lval* s = a->cell[0];
+	lval* old = a->cell[1];
+	lval* new = a->cell[2];
+
+	long count = 0;
+	for (long i = lstr_find(s, old, 0); i != -1; i = lstr_find(s, old, i + old->len)) count++;
+	if (count == 0) {
+		lval* x = lval_pop(a, 0);
+		lval_del(a);
+		return x;
+	}
 
-	for (int i = 0; i < a->cell[0]->count; i++) {
-		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM), "Cannot define non-symbol. Got %s, Expected %s.", ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+	long len = s->len + count * (new->len - old->len);
+	lval* x = lval_str_alloc(len);
+	char* src = lstr_chars(s);
+	long pos = 0;
+	long start = 0;
+	for (long i = lstr_find(s, old, 0); i != -1; i = lstr_find(s, old, start)) {
+		memcpy(x->str + pos, src + start, i - start);
+		pos += i - start;
+		memcpy(x->str + pos, lstr_chars(new), new->len);
+		pos += new->len;
+		start = i + old->len;
 	}
+	memcpy(x->str + pos, src + start, s->len - start);
+	x->str[len] = '\0';
 
-	lval* formals = lval_pop(a, 0);
-	lval* body = lval_pop(a, 0);
 	lval_del(a);
-
-	return lval_lambda(formals, body);
+	return x;
 }
 
-lval* builtin_print(lenv* e, lval* a) {
+lval* builtin_str_upper(lenv* e, lval* a) {
+	LASSERT_NUM("str-upper", a, 1);
+	LASSERT_TYPE("str-upper", a, 0, LVAL_STR);
 
-	for (int i = 0; i < a->count; i++) {
-		lval_print(a->cell[i]);
-		putchar(' ');
-	}
+	lval* s = a->cell[0];
+	lval* x = lval_str_alloc(s->len);
+	kernels.str_upper(x->str, lstr_chars(s), s->len);
+	x->str[s->len] = '\0';
 
-	putchar('\n');
 	lval_del(a);
-
-	return lval_sexpr();
+	return x;
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-	LASSERT_NUM("error", a, 1);
-	LASSERT_TYPE("error", a, 0, LVAL_STR);
+/* Integers become Integers, or big integers when they need to, anything else strtod takes a Number */
+lval* builtin_str_to_num(lenv* e, lval* a) {
+	LASSERT_NUM("str->num", a, 1);
+	LASSERT_TYPE("str->num", a, 0, LVAL_STR);
+
+	char* s = lval_str_flat(a->cell[0]);
+	long len = a->cell[0]->len;
+
+	long digits = s[0] == '-';
+	while (digits < len && s[digits] >= '0' && s[digits] <= '9') digits++;
+	if (digits == len && len > (s[0] == '-')) {
+		lval* x = lval_parse_int(s);
+		lval_del(a);
+		return x;
+	}
 
-	lval* err = lval_err(a->cell[0]->str);
+	/* strtod would skip leading whitespace, which an Integer does not allow either */
+	char* end;
+	double d = strtod(s, &end);
+	LASSERT(a, len != 0 && !isspace((unsigned char)s[0]) && end == s + len,
+		"Function 'str->num' passed \"%s\", which is not a number.", s);
 
 	lval_del(a);
-	return err;
+	return lval_num(d);
 }
 
 lval* builtin_load(lenv* e, lval* a) {
@@ -919,7 +5277,7 @@ lval* builtin_load(lenv* e, lval* a) {
 	LASSERT_TYPE("load", a, 0, LVAL_STR);
 
 	mpc_result_t r;
-	if (mpc_parse_contents(a->cell[0]->str, Tea, &r)) {
+	if (mpc_parse_contents(lval_str_flat(a->cell[0]), Tea, &r)) {
 
 		lval* expr = lval_read(r.output);
 
@@ -950,6 +5308,23 @@ lval* builtin_load(lenv* e, lval* a) {
 	}
 }
 
+/* Seconds of wall time since an earlier reading, or since an arbitrary start given 0 */
+lval* builtin_clock(lenv* e, lval* a) {
+	LASSERT_NUM("clock", a, 1);
+	LASSERT_NUMBER("clock", a, 0);
+
+	double since = lval_to_double(a->cell[0]);
+	lval_del(a);
+	/* Strict ISO modes leave out the POSIX clocks, CPU time is the fallback */
+#ifdef CLOCK_MONOTONIC
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return lval_num(t.tv_sec + t.tv_nsec / 1e9 - since);
+#else
+	return lval_num((double)clock() / CLOCKS_PER_SEC - since);
+#endif
+}
+
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
 	lval* k = lval_sym(name);
 	lval* v = lval_fun(func, name);
@@ -968,6 +5343,54 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "join", builtin_join);
 	lenv_add_builtin(e, "init", builtin_init);
 	lenv_add_builtin(e, "cons", builtin_cons);
+	lenv_add_builtin(e, "slice", builtin_slice);
+
+	/* Vector Functions */
+	lenv_add_builtin(e, "vec", builtin_vec);
+	lenv_add_builtin(e, "nth", builtin_nth);
+	lenv_add_builtin(e, "vec-set", builtin_vec_set);
+	lenv_add_builtin(e, "vec-set!", builtin_vec_set_in_place);
+	lenv_add_builtin(e, "push", builtin_push);
+
+	/* Hash Functions */
+	lenv_add_builtin(e, "hash-map", builtin_hash_map);
+	lenv_add_builtin(e, "hash-set", builtin_hash_set);
+	lenv_add_builtin(e, "hash-get", builtin_hash_get);
+	lenv_add_builtin(e, "hash-has", builtin_hash_has);
+	lenv_add_builtin(e, "hash-put", builtin_hash_put);
+	lenv_add_builtin(e, "hash-put!", builtin_hash_put_in_place);
+	lenv_add_builtin(e, "hash-del", builtin_hash_del);
+	lenv_add_builtin(e, "hash-del!", builtin_hash_del_in_place);
+	lenv_add_builtin(e, "hash-keys", builtin_hash_keys);
+	lenv_add_builtin(e, "hash-vals", builtin_hash_vals);
+	lenv_add_builtin(e, "hash-items", builtin_hash_items);
+
+	/* Persistent Collection Functions */
+	lenv_add_builtin(e, "pvec", builtin_pvec);
+	lenv_add_builtin(e, "pmap", builtin_pmap);
+	lenv_add_builtin(e, "conj", builtin_conj);
+	lenv_add_builtin(e, "assoc", builtin_assoc);
+	lenv_add_builtin(e, "dissoc", builtin_dissoc);
+	lenv_add_builtin(e, "get", builtin_get);
+	lenv_add_builtin(e, "items", builtin_items);
+
+	/* Array Functions */
+	lenv_add_builtin(e, "i64", builtin_i64);
+	lenv_add_builtin(e, "f64", builtin_f64);
+	lenv_add_builtin(e, "iota", builtin_iota);
+	lenv_add_builtin(e, "v+", builtin_vadd);
+	lenv_add_builtin(e, "v-", builtin_vsub);
+	lenv_add_builtin(e, "v*", builtin_vmul);
+	lenv_add_builtin(e, "v/", builtin_vdiv);
+	lenv_add_builtin(e, "vsum", builtin_vsum);
+	lenv_add_builtin(e, "vmin", builtin_vmin);
+	lenv_add_builtin(e, "vmax", builtin_vmax);
+	lenv_add_builtin(e, "vdot", builtin_vdot);
+	lenv_add_builtin(e, "reshape", builtin_reshape);
+	lenv_add_builtin(e, "shape", builtin_shape);
+	lenv_add_builtin(e, "transpose", builtin_transpose);
+	lenv_add_builtin(e, "matmul", builtin_matmul);
+	lenv_add_builtin(e, "matvec", builtin_matvec);
 
 	/* Mathematical Functions */
 	lenv_add_builtin(e, "+", builtin_add);
@@ -983,8 +5406,13 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "def", builtin_def);
 	lenv_add_builtin(e, "=", builtin_put);
 	lenv_add_builtin(e, "\\", builtin_lambda);
+	lenv_add_builtin(e, "defrecord", builtin_defrecord);
 	lenv_add_builtin(e, "print_all", builtin_print_all);
 
+	/* Memory Functions */
+	lenv_add_builtin(e, "gc", builtin_gc);
+	lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+
 	/* Comparision Functions */
 	lenv_add_builtin(e, "if", builtin_if);
 	lenv_add_builtin(e, "==", builtin_eq);
@@ -1001,128 +5429,669 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "load", builtin_load);
 	lenv_add_builtin(e, "error", builtin_error);
 	lenv_add_builtin(e, "print", builtin_print);
+	lenv_add_builtin(e, "str-append", builtin_str_append);
+	lenv_add_builtin(e, "str-join", builtin_str_join);
+	lenv_add_builtin(e, "str-build", builtin_str_build);
+	lenv_add_builtin(e, "str-len", builtin_str_len);
+	lenv_add_builtin(e, "substr", builtin_substr);
+	lenv_add_builtin(e, "str-find", builtin_str_find);
+	lenv_add_builtin(e, "str-split", builtin_str_split);
+	lenv_add_builtin(e, "str-replace", builtin_str_replace);
+	lenv_add_builtin(e, "str-upper", builtin_str_upper);
+	lenv_add_builtin(e, "str->num", builtin_str_to_num);
+
+	/* System Functions */
+	lenv_add_builtin(e, "clock", builtin_clock);
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
+lval* lval_eval_sym(lenv* e, lval* v) {
+
+	if (v->sym == atom_exit) exit(0);
+
+	if (v->sym == atom_print_all) {
+		for (int i = 0; i < e->count; i++) {
+			printf("%s\n", e->syms[i]);
+		}
+	}
+
+	return lenv_get(e, v);
+}
+
+/* A user function runs once every formal is bound, until then calls partially apply it */
+int lval_bound(lval* f) {
+	return f->env->bound == f->formals->count;
+}
 
-	if (f->builtin) return f->builtin(e, a);
+/* Binds arguments 'a' to the formals of user function 'f', consuming both.
+ * Returns the function ready to run once all formals are bound, a partially
+ * applied function, or an error. Formals fill the frame's slots in order, so
+ * compiled code can address them by position */
+lval* lval_bind(lenv* e, lval* f, lval* a) {
+
+	/* Binding fills the frame, so work on a private copy */
+	f = lval_mut(f);
+
+	lenv* env = f->env;
+	lval** formals = f->formals->cell;
+	int count = f->formals->count;
 
 	int given = a->count;
-	int total = f->formals->count;
+	int total = count - env->bound;
 
 	while (a->count) {
 
-		if (f->formals->count == 0) {
+		if (env->bound == count) {
 			lval_del(a);
+			lval_del(f);
 			return lval_err("Function passed too many arguments. Got %i, Expected %i.", given, total);
 		}
 
-		lval* sym = lval_pop(f->formals, 0);
+		lval* sym = formals[env->bound++];
 
-		if (strcmp(sym->sym, "&") == 0) {
+		if (sym->sym == atom_amp) {
 
-			if (f->formals->count != 1) {
+			if (env->bound != count - 1) {
 				lval_del(a);
+				lval_del(f);
 				return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
 			}
 
-			lval* nsym = lval_pop(f->formals, 0);
-			lenv_put(f->env, nsym, builtin_list(e, a));
-			lval_del(sym);
-			lval_del(nsym);
+			lenv_put(env, formals[env->bound++], builtin_list(e, a));
 			break;
 		}
 
 		lval* val = lval_pop(a, 0);
-
-		lenv_put(f->env, sym, val);
-
-		lval_del(sym);
+		lenv_put(env, sym, val);
 		lval_del(val);
 	}
 
 	lval_del(a);
 
-	if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+	if (env->bound < count && formals[env->bound]->sym == atom_amp) {
 
-		if (f->formals->count != 2) {
+		if (count - env->bound != 2) {
+			lval_del(f);
 			return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
 		}
 
-		lval_del(lval_pop(f->formals, 0));
-
-		lval* sym = lval_pop(f->formals, 0);
 		lval* val = lval_qexpr();
-
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
+		lenv_put(env, formals[env->bound + 1], val);
 		lval_del(val);
+		env->bound = count;
 	}
 
-	if (f->formals->count == 0) {
+	env->slots = env->count;
+	return f;
+}
+
+lcode* lval_code(lval* v, lenv* e);
+lval* vm_run(lenv* e, lcode* c);
 
-		f->env->par = e;
+lval* lval_call(lenv* e, lval* f, lval* a) {
 
-		return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+	if (f->builtin) {
+		lbuiltin builtin = f->builtin;
+		if (f->body) a = lval_push(a, lval_copy(f->body));
+		lval_del(f);
+		return builtin(e, a);
 	}
-	else {
-		return lval_copy(f);
+
+	f = lval_bind(e, f, a);
+	if (f->type == LVAL_ERR || !lval_bound(f)) return f;
+
+	gc_maybe_collect();
+
+	lval* result = vm_run(f->env, lval_code(f->body, f->env));
+	lval_del(f);
+	return result;
+}
+
+/* Bytecode Compiler */
+
+/*
+ * S-expressions are compiled once into a flat instruction stream and cached on
+ * the list they came from, so function bodies and 'if' branches are no longer
+ * re-walked and re-copied on every evaluation. Each instruction is an opcode
+ * followed by its operands.
+ */
+enum {
+	OP_CONST,  /* a: push constant a */
+	OP_LOAD,   /* a: push the value bound to symbol constant a */
+	OP_LOCAL,  /* a, b, c: push slot b of the frame a levels out, or look up
+	              symbol constant c by name if a frame in between gained bindings */
+	OP_CALL,   /* a: apply the top a values as an S-expression */
+	OP_TAILCALL, /* a: as OP_CALL in tail position, reusing this frame for the callee */
+	OP_DEF,    /* a: as OP_CALL, binding directly when the head is 'def' or '=' */
+	OP_LAMBDA, /* a: as OP_CALL, building the function directly when the head is '\' */
+	OP_IF,     /* a, b: pop head and condition, fall through on true, jump to a on
+	              false, or to b to call the head as a function instead */
+	OP_JUMP,   /* a: continue at a */
+	OP_RETURN  /* return the top value */
+};
+
+struct lcode {
+	int refs;
+
+	int count;
+	int capacity;
+	int* ops;
+
+	int const_count;
+	int const_capacity;
+	lval** consts;
+
+	/* Slot layouts of the function frames symbols were resolved against, innermost first */
+	int scope_count;
+	lval** scope;
+};
+
+/* Code is shared between its list and every vm_run still executing it */
+void lcode_del(lcode* c) {
+	if (--c->refs > 0) return;
+
+	for (int i = 0; i < c->const_count; i++) {
+		lval_del(c->consts[i]);
+	}
+	for (int i = 0; i < c->scope_count; i++) {
+		lval_del(c->scope[i]);
+	}
+	free(c->scope);
+	free(c->consts);
+	free(c->ops);
+	free(c);
+}
+
+int code_emit(lcode* c, int op) {
+	if (c->count == c->capacity) {
+		c->capacity = c->capacity ? c->capacity * 2 : 16;
+		c->ops = realloc(c->ops, sizeof(int) * c->capacity);
 	}
+	c->ops[c->count] = op;
+	return c->count++;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+/* Adds 'v' to the constant table, taking ownership of it */
+int code_const(lcode* c, lval* v) {
+	if (c->const_count == c->const_capacity) {
+		c->const_capacity = c->const_capacity ? c->const_capacity * 2 : 8;
+		c->consts = realloc(c->consts, sizeof(lval*) * c->const_capacity);
+	}
+	c->consts[c->const_count] = v;
+	return c->const_count++;
+}
 
-	for (int i = 0; i < v->count; i++) {
-		v->cell[i] = lval_eval(e, v->cell[i]);
+void compile_list(lcode* c, lval* v, int tail);
+
+/* Returns the slot holding 'sym' in a frame with this layout, or -1 */
+int layout_slot(lval* layout, char* sym) {
+	int slot = 0;
+	for (int i = 0; i < layout->count; i++) {
+		char* f = layout->cell[i]->sym;
+		if (f == atom_amp) continue;
+		if (f == sym) return slot;
+
+		/* A repeated formal rebinds the slot of its first occurrence */
+		int seen = 0;
+		for (int j = 0; j < i; j++) {
+			if (layout->cell[j]->sym == f) seen = 1;
+		}
+		if (!seen) slot++;
+	}
+	return -1;
+}
+
+/* Symbols held in a slot of an enclosing function frame compile to a slot load,
+ * anything else is looked up by name when the code runs */
+void compile_sym(lcode* c, lval* v) {
+	int special = v->sym == atom_exit || v->sym == atom_print_all;
+
+	for (int depth = 0; depth < c->scope_count && !special; depth++) {
+		int slot = layout_slot(c->scope[depth], v->sym);
+		if (slot != -1) {
+			code_emit(c, OP_LOCAL);
+			code_emit(c, depth);
+			code_emit(c, slot);
+			code_emit(c, code_const(c, lval_copy(v)));
+			return;
+		}
+	}
+
+	code_emit(c, OP_LOAD);
+	code_emit(c, code_const(c, lval_copy(v)));
+}
+
+/* 'tail' is set when the value of 'v' is returned straight from the code */
+void compile_expr(lcode* c, lval* v, int tail) {
+	switch (v->type) {
+	case LVAL_SYM:
+		compile_sym(c, v);
+		break;
+	case LVAL_SEXPR:
+		compile_list(c, v, tail);
+		break;
+	default:
+		code_emit(c, OP_CONST);
+		code_emit(c, code_const(c, lval_copy(v)));
+		break;
+	}
+}
+
+/* (if cond {then} {else}) with literal branches compiles to jumps, falling
+ * back to an ordinary call when 'if' is rebound or the condition is not a
+ * Boolean so that errors match builtin_if exactly */
+void compile_if(lcode* c, lval* v, int tail) {
+	compile_expr(c, v->cell[0], 0);
+	compile_expr(c, v->cell[1], 0);
+
+	code_emit(c, OP_IF);
+	int else_at = code_emit(c, 0);
+	int call_at = code_emit(c, 0);
+
+	/* In tail position each branch returns directly, keeping its calls in tail position too */
+	compile_list(c, v->cell[2], tail);
+	code_emit(c, tail ? OP_RETURN : OP_JUMP);
+	int then_end = tail ? -1 : code_emit(c, 0);
+
+	c->ops[else_at] = c->count;
+	compile_list(c, v->cell[3], tail);
+	code_emit(c, tail ? OP_RETURN : OP_JUMP);
+	int else_end = tail ? -1 : code_emit(c, 0);
+
+	c->ops[call_at] = c->count;
+	compile_expr(c, v->cell[2], 0);
+	compile_expr(c, v->cell[3], 0);
+	code_emit(c, tail ? OP_TAILCALL : OP_CALL);
+	code_emit(c, 4);
+
+	if (!tail) {
+		c->ops[then_end] = c->count;
+		c->ops[else_end] = c->count;
+	}
+}
+
+/* Compiles the evaluation of list 'v' as an S-expression, whatever its tag */
+void compile_list(lcode* c, lval* v, int tail) {
+
+	if (v->count == 0) {
+		code_emit(c, OP_CONST);
+		code_emit(c, code_const(c, lval_sexpr()));
+		return;
+	}
+
+	if (v->count == 1) {
+		compile_expr(c, v->cell[0], tail);
+		return;
+	}
+
+	lval* head = v->cell[0];
+	char* sym = head->type == LVAL_SYM ? head->sym : NULL;
+
+	if (sym == atom_if && v->count == 4
+		&& v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR) {
+		compile_if(c, v, tail);
+		return;
 	}
 
 	for (int i = 0; i < v->count; i++) {
-		if (v->cell[i]->type == LVAL_ERR) return lval_take(v, i);
+		compile_expr(c, v->cell[i], 0);
+	}
+
+	if (sym == atom_def || sym == atom_put) code_emit(c, OP_DEF);
+	else if (sym == atom_lambda) code_emit(c, OP_LAMBDA);
+	else code_emit(c, tail ? OP_TAILCALL : OP_CALL);
+	code_emit(c, v->count);
+}
+
+/* Compiles 'v' to run in frame 'e', resolving symbols against the function
+ * frames on its lexical chain. A NULL 'e' resolves everything by name */
+lcode* lval_compile(lval* v, lenv* e) {
+	lcode* c = calloc(1, sizeof(lcode));
+	c->refs = 1;
+
+	for (lenv* x = e; x && x->layout; x = x->par) {
+		c->scope = realloc(c->scope, sizeof(lval*) * (c->scope_count + 1));
+		c->scope[c->scope_count++] = lval_copy(x->layout);
+	}
+
+	compile_list(c, v, 1);
+	code_emit(c, OP_RETURN);
+	return c;
+}
+
+int code_in_scope(lcode* c, lenv* e) {
+	for (int i = 0; i < c->scope_count; i++) {
+		if (!e || !e->layout) return 0;
+		if (e->layout != c->scope[i] && !lval_eq(e->layout, c->scope[i])) return 0;
+		e = e->par;
+	}
+	return !e || !e->layout;
+}
+
+/* Returns the cached code for running 'v' in frame 'e', recompiling it when
+ * it was resolved against differently shaped frames */
+lcode* lval_code(lval* v, lenv* e) {
+	if (v->code && code_in_scope(v->code, e)) return v->code;
+
+	if (v->code) lcode_del(v->code);
+	v->code = lval_compile(v, e);
+	return v->code;
+}
+
+/* Virtual Machine */
+
+typedef struct {
+	int count;
+	int capacity;
+	lval** stack;
+} lvm;
+
+lvm vm;
+
+void vm_push(lval* v) {
+	if (vm.count == vm.capacity) {
+		vm.capacity = vm.capacity ? vm.capacity * 2 : 256;
+		vm.stack = realloc(vm.stack, sizeof(lval*) * vm.capacity);
+	}
+	vm.stack[vm.count++] = v;
+}
+
+void vm_release(int n) {
+	while (n--) lval_del(vm.stack[--vm.count]);
+}
+
+/* Returns the first error among the top 'n' values, or NULL */
+lval* vm_find_err(int n) {
+	for (int i = vm.count - n; i < vm.count; i++) {
+		if (vm.stack[i]->type == LVAL_ERR) return vm.stack[i];
 	}
+	return NULL;
+}
 
-	if (v->count == 0) return v;
+/* Moves the top 'n' values into a new argument list */
+lval* vm_args(int n) {
+	lval* a = lval_sexpr();
+	if (n) {
+		a->cells = lcells_new(n);
+		a->cells->hi = n;
+		a->count = n;
+		a->cell = a->cells->slots;
+		memcpy(a->cell, &vm.stack[vm.count - n], sizeof(lval*) * n);
+		vm.count -= n;
+	}
+	return a;
+}
 
-	if (v->count == 1) return lval_take(v, 0);
+/* Applies the top 'n' values as an S-expression, consuming them */
+lval* vm_apply(lenv* e, int n) {
+	lval* err = vm_find_err(n);
+	if (err) {
+		err = lval_copy(err);
+		vm_release(n);
+		return err;
+	}
 
-	lval* f = lval_pop(v, 0);
+	lval* f = vm.stack[vm.count - n];
 	if (f->type != LVAL_FUN) {
-		lval* err = lval_err("S-Expression starts with incorrect type. Got %s, Expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
-		lval_del(f);
-		lval_del(v);
+		err = lval_err("S-Expression starts with incorrect type. Got %s, Expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
+		vm_release(n);
 		return err;
 	}
 
-	lval* result = lval_call(e, f, v);
-	lval_del(f);
-	return result;
+	lval* a = vm_args(n - 1);
+	vm.count--;
+
+	return lval_call(e, f, a);
 }
 
-lval* lval_eval(lenv* e, lval* v) {
+/* Binds 'def'/'=' arguments straight off the stack, or returns NULL to fall back to a call */
+lval* vm_def(lenv* e, int n) {
+	lval** items = &vm.stack[vm.count - n];
+	lval* f = items[0];
+	lval* syms = items[1];
 
-	if (v->type == LVAL_SYM) {
+	if (f->type != LVAL_FUN || (f->builtin != builtin_def && f->builtin != builtin_put)) return NULL;
+	if (vm_find_err(n) || syms->type != LVAL_QEXPR || syms->count != n - 2) return NULL;
+	for (int i = 0; i < syms->count; i++) {
+		if (syms->cell[i]->type != LVAL_SYM) return NULL;
+	}
+
+	for (int i = 0; i < syms->count; i++) {
+		if (f->builtin == builtin_def) lenv_def(e, syms->cell[i], items[i + 2]);
+		else lenv_put(e, syms->cell[i], items[i + 2]);
+	}
+
+	vm_release(n);
+	return lval_sexpr();
+}
+
+/* Builds a lambda straight off the stack, or returns NULL to fall back to a call */
+lval* vm_lambda(lenv* e, int n) {
+	lval** items = &vm.stack[vm.count - n];
+	lval* f = items[0];
+
+	if (n != 3 || f->type != LVAL_FUN || f->builtin != builtin_lambda) return NULL;
+	if (items[1]->type != LVAL_QEXPR || items[2]->type != LVAL_QEXPR) return NULL;
+	for (int i = 0; i < items[1]->count; i++) {
+		if (items[1]->cell[i]->type != LVAL_SYM) return NULL;
+	}
+
+	lval* v = lval_lambda(e, items[1], items[2]);
+	vm.count -= 2;
+	vm_release(1);
+	return v;
+}
+
+/* Works out where a call in tail position continues: the body of a user
+ * function or the chosen branch of 'if'/'eval'. Returns the function or list
+ * to run in frame '*e', consuming the top 'n' values. Returns NULL when the
+ * call has to be made normally, or sets '*result' if binding already produced
+ * the value (an error or a partial application) */
+lval* vm_tail_target(lenv** e, int n, lval** result) {
+	lval* f = vm.stack[vm.count - n];
+	if (f->type != LVAL_FUN || vm_find_err(n)) return NULL;
+
+	if (!f->builtin) {
+		lval* a = vm_args(n - 1);
+		vm.count--;
+
+		f = lval_bind(*e, f, a);
+		if (f->type == LVAL_ERR || !lval_bound(f)) {
+			*result = f;
+			return NULL;
+		}
+
+		*e = f->env;
+		return f;
+	}
+
+	lval** args = &vm.stack[vm.count - n + 1];
+	lval* target = NULL;
+
+	if (f->builtin == builtin_if && n == 4 && args[0]->type == LVAL_BOOL
+		&& args[1]->type == LVAL_QEXPR && args[2]->type == LVAL_QEXPR) {
+		target = args[args[0]->bool ? 1 : 2];
+	}
+	if (f->builtin == builtin_eval && n == 2 && args[0]->type == LVAL_QEXPR) {
+		target = args[0];
+	}
+
+	if (target) {
+		lval_copy(target);
+		vm_release(n);
+	}
+	return target;
+}
 
-		if (strcmp(v->sym, "exit") == 0) exit(0);
+lval* vm_run(lenv* e, lcode* c) {
+	int* ops = c->ops;
+	int pc = 0;
+	c->refs++;
 
-		if (strcmp(v->sym, "print_all") == 0) {
-			for (int i = 0; i < e->count; i++) {
-				printf("%s\n", e->syms[i]);
+	/* After a tail call the frame owns the function or list being run and its environment */
+	lval* hold = NULL;
+	lenv* held_env = NULL;
+
+	for (;;) {
+		switch (ops[pc]) {
+
+		case OP_CONST:
+			vm_push(lval_copy(c->consts[ops[pc + 1]]));
+			pc += 2;
+			break;
+
+		case OP_LOAD:
+			vm_push(lval_eval_sym(e, c->consts[ops[pc + 1]]));
+			pc += 2;
+			break;
+
+		case OP_LOCAL: {
+			lenv* x = e;
+			for (int depth = ops[pc + 1]; depth > 0 && x; depth--) {
+				x = x->count == x->slots ? x->par : NULL;
+			}
+			lval* v = x ? lenv_slot(x, ops[pc + 2]) : NULL;
+			vm_push(v ? lval_copy(v) : lval_eval_sym(e, c->consts[ops[pc + 3]]));
+			pc += 4;
+			break;
+		}
+
+		case OP_CALL:
+			vm_push(vm_apply(e, ops[pc + 1]));
+			pc += 2;
+			break;
+
+		case OP_TAILCALL: {
+			int n = ops[pc + 1];
+			lval* result = NULL;
+			lval* target = vm_tail_target(&e, n, &result);
+
+			if (!target) {
+				vm_push(result ? result : vm_apply(e, n));
+				pc += 2;
+				break;
+			}
+
+			lcode* next = target->type == LVAL_FUN ? lval_code(target->body, e) : lval_code(target, NULL);
+			next->refs++;
+			lcode_del(c);
+			c = next;
+			ops = c->ops;
+			pc = 0;
+
+			e->refs++;
+			if (held_env) lenv_del(held_env);
+			held_env = e;
+			if (hold) lval_del(hold);
+			hold = target;
+
+			gc_maybe_collect();
+			break;
+		}
+
+		case OP_DEF: {
+			lval* x = vm_def(e, ops[pc + 1]);
+			vm_push(x ? x : vm_apply(e, ops[pc + 1]));
+			pc += 2;
+			break;
+		}
+
+		case OP_LAMBDA: {
+			lval* x = vm_lambda(e, ops[pc + 1]);
+			vm_push(x ? x : vm_apply(e, ops[pc + 1]));
+			pc += 2;
+			break;
+		}
+
+		case OP_IF: {
+			lval* f = vm.stack[vm.count - 2];
+			lval* cond = vm.stack[vm.count - 1];
+
+			if (f->type == LVAL_FUN && f->builtin == builtin_if && cond->type == LVAL_BOOL) {
+				int taken = cond->bool;
+				vm_release(2);
+				pc = taken ? pc + 3 : ops[pc + 1];
 			}
+			else {
+				pc = ops[pc + 2];
+			}
+			break;
+		}
+
+		case OP_JUMP:
+			pc = ops[pc + 1];
+			break;
+
+		case OP_RETURN: {
+			lval* x = vm.stack[--vm.count];
+			lcode_del(c);
+			if (hold) lval_del(hold);
+			if (held_env) lenv_del(held_env);
+			return x;
+		}
 		}
+	}
+}
+
+void vm_cleanup(void) {
+	free(vm.stack);
+}
 
-		lval* x = lenv_get(e, v);
+/* Evaluates list 'v' as an S-expression without consuming it */
+lval* lval_eval_list(lenv* e, lval* v) {
+	return vm_run(e, lval_code(v, NULL));
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+
+	if (v->type == LVAL_SYM) {
+		lval* x = lval_eval_sym(e, v);
 		lval_del(v);
 		return x;
 	}
 
-	if (v->type == LVAL_SEXPR) return lval_eval_sexpr(e, v);
+	if (v->type == LVAL_SEXPR) {
+		lval* x = lval_eval_list(e, v);
+		lval_del(v);
+		return x;
+	}
 
 	return v;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
+/* Reads 's', an optional '-' and then decimal digits, exactly: as a bignum
+ * when it is too large for a long long */
+lval* lval_parse_int(char* s) {
 	errno = 0;
-	double x = atof(t->contents);
-	return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+	long long n = strtoll(s, NULL, 10);
+	if (errno != ERANGE) return lval_int(n);
+
+	char* digits = s + (s[0] == '-');
+	int len = strlen(digits);
+
+	/* Nine digits at a time: b = b * 10^k + chunk */
+	lbig b = lbig_from_int(0);
+	for (int i = 0; i < len; i += 9) {
+		int k = len - i < 9 ? len - i : 9;
+		unsigned scale = 1, chunk = 0;
+		for (int j = 0; j < k; j++) {
+			scale *= 10;
+			chunk = chunk * 10 + (digits[i + j] - '0');
+		}
+
+		unsigned st[2], ct[2];
+		lval s = { .type = LVAL_INT, .integer = scale };
+		lval c = { .type = LVAL_INT, .integer = chunk };
+		lbig sw = lbig_view(&s, st), cw = lbig_view(&c, ct);
+		lbig_mul(&b, &sw);
+		lbig_add(&b, &cw);
+	}
+
+	if (s[0] == '-') b.sign = -b.sign;
+	return lval_big(b);
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+	return lval_parse_int(t->contents);
 }
 
 lval* lval_read_bool(mpc_ast_t* t) {
@@ -1130,18 +6099,65 @@ lval* lval_read_bool(mpc_ast_t* t) {
 	return lval_bool(0);
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
-	t->contents[strlen(t->contents) - 1] = '\0';
+/* The character an escape sequence '\c' stands for, or -1 if mpc's C string
+ * table does not know it and the backslash is kept */
+int lstr_unescape(char c) {
+	switch (c) {
+	case 'a': return '\a';
+	case 'b': return '\b';
+	case 'f': return '\f';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 't': return '\t';
+	case 'v': return '\v';
+	case '\\': return '\\';
+	case '\'': return '\'';
+	case '"': return '"';
+	case '0': return '\0';
+	}
+	return -1;
+}
 
-	char* unescaped = malloc(strlen(t->contents + 1) + 1);
-	strcpy(unescaped, t->contents + 1);
+/* Literals without a backslash are copied once into the new string; otherwise
+ * the text between backslashes is copied in bulk */
+lval* lval_read_str(mpc_ast_t* t) {
+	char* s = t->contents + 1;
+	long n = strlen(s) - 1;
+
+	long i = kernels.str_find(s, n, "\\", 1);
+	if (i == -1) {
+		lval* str = lval_str_alloc(n);
+		memcpy(str->str, s, n);
+		str->str[n] = '\0';
+		return str;
+	}
 
-	unescaped = mpcf_unescape(unescaped);
+	char* r = malloc(n + 1);
+	long len = 0;
+	long start = 0;
+
+	while (i != -1) {
+		memcpy(r + len, s + start, i - start);
+		len += i - start;
+
+		int c = lstr_unescape(s[i + 1]);
+		if (c == -1) {
+			r[len++] = '\\';
+			start = i + 1;
+		} else {
+			/* mpc builds C strings, so '\0' has always read as nothing */
+			if (c) r[len++] = c;
+			start = i + 2;
+		}
 
-	lval* str = lval_str(unescaped);
+		long next = start < n ? kernels.str_find(s + start, n - start, "\\", 1) : -1;
+		i = next == -1 ? -1 : start + next;
+	}
 
-	free(unescaped);
-	return str;
+	memcpy(r + len, s + start, n - start);
+	len += n - start;
+	r[len] = '\0';
+	return lval_str_take(r, len);
 }
 
 lval* lval_read(mpc_ast_t* t) {
@@ -1186,7 +6202,7 @@ int main(int argc, char** argv) {
 	mpca_lang(MPCA_LANG_DEFAULT,
 		"                                                                          \
 			number   : /-?[0-9]+/ ;                                                \
-			symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;                         \
+			symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^]+/ ;                        \
             boolean  : \"true\" | \"false\" ;                                      \
             string   : /\"(\\\\.|[^\"])*\"/ ;                                      \
 			comment  : /;[^\\r\\n]*/ ;                                             \
@@ -1198,6 +6214,10 @@ int main(int argc, char** argv) {
 		",
 		Number, Symbol, Boolean, String, Comment, Sexpr, Qexpr, Expr, Tea);
 
+	atoms_init();
+	lval_small_nums_init();
+	lkernels_init();
+
 	lenv* e = lenv_new();
 	lenv_add_builtins(e);
 
@@ -1253,7 +6273,14 @@ int main(int argc, char** argv) {
 	}
 
 
+	/* Closures refer back to the environment defining them, so collect the cycles */
 	lenv_del(e);
+	gc_collect();
+	vm_cleanup();
+	gc_cleanup();
+	pool_cleanup(&lval_pool);
+	pool_cleanup(&lenv_pool);
+	atoms_cleanup();
 
 	mpc_cleanup(9, Number, Symbol, Boolean, String, Comment, Sexpr, Qexpr, Expr, Tea);
 